@@ -15,6 +15,8 @@ extern "C" void app_main() {
 }
 #endif
 
+// pkt lives in the receive arena and is only valid until this callback returns.
+// Do not delete or keep it, use pkt->copy() for anything needed later.
 void onPktReceived(const std::string& command, rbjson::Object* pkt) {
     if (command == "joy") {
         printf("Joy: ");
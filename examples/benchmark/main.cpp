@@ -0,0 +1,911 @@
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbjson.h"
+#include "rbjson_bind.h"
+#include "rbprotocol.h"
+#include "rbwebserver.h"
+#include "rbwifi.h"
+
+#ifdef RBPROTOCOL_USE_NETIF
+#include <esp_netif.h>
+#else
+#include <tcpip_adapter.h>
+#endif
+
+// jsmn_parse() is compiled into rbjson, only its declarations are needed here
+#define JSMN_HEADER
+#include "jsmn.h"
+
+// From mpaland-printf, its header would redirect this file's printf.
+extern "C" int fctprintf(void (*out)(char character, void* arg), void* arg, const char* format, ...);
+
+#ifndef LX16A_ARDUINO
+void setup();
+extern "C" void app_main() {
+    setup();
+}
+#endif
+
+static volatile size_t g_sink;
+
+template <typename F>
+static void bench(const char* name, uint32_t iterations, F fn) {
+    const int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    const int64_t elapsed = esp_timer_get_time() - start;
+    printf("%-44s %7u iterations %10.1f ns/op\n", name, (unsigned)iterations, double(elapsed) * 1000.0 / iterations);
+}
+
+static const float NUMBERS[] = {
+    0, 1, -1, 32767, -32767, 1234, -17, 100000,
+    0.5f, -0.25f, 3.14159f, 1234.5678f, -0.0001f, 12.75f, 99.9f, 0.001f,
+};
+static const size_t NUMBERS_COUNT = sizeof(NUMBERS) / sizeof(NUMBERS[0]);
+
+static void fct_writer(char c, void* arg) {
+    ((rbjson::Writer*)arg)->put(c);
+}
+
+// The number serialization used before rbjson::formatDouble
+static void format_number_printf(rbjson::Writer& w, float value) {
+    float intpart;
+    float fracpart = fabsf(modff(value, &intpart));
+    if (fracpart < 0.0001f) {
+        fctprintf(fct_writer, &w, "%lld", (long long)value);
+    } else {
+        fctprintf(fct_writer, &w, "%.4f", value);
+    }
+}
+
+static void bench_number_format() {
+    printf("\n== Number formatting, %u mixed values ==\n", (unsigned)NUMBERS_COUNT);
+
+    char buf[256];
+    bench("modff + fctprintf(%.4f)", 20000, [&](uint32_t i) {
+        rbjson::Writer w(buf, sizeof(buf));
+        format_number_printf(w, NUMBERS[i % NUMBERS_COUNT]);
+        g_sink += w.size();
+    });
+
+    bench("rbjson::formatDouble", 20000, [&](uint32_t i) {
+        g_sink += rbjson::formatDouble(buf, NUMBERS[i % NUMBERS_COUNT]);
+    });
+
+    bench("rbjson::formatInt", 20000, [&](uint32_t i) {
+        g_sink += rbjson::formatInt(buf, int64_t(NUMBERS[i % 8]));
+    });
+}
+
+static const char* const LOG_STRINGS[] = {
+    "The device n has been possessed!\n",
+    "Battery 7.42 V, motor left 1234 right -1234, encoders 102938 / 102877, "
+    "ultrasound 31 cm, line sensors 0 0 1 1 0 0 0 0, free heap 123456 B, "
+    "uptime 3600 s, wifi rssi -61 dBm, queue depth 0, packets in 12345 out 12340, "
+    "last error none, mode autonomous, arm at 90 45 12 deg, gripper open\n",
+    "config \"wifi\" loaded from /spiffs/config.json: {\"ssid\":\"RBController\",\"channel\":6}\n"
+    "\tfallback to AP mode in 10 s\n",
+};
+static const size_t LOG_STRINGS_COUNT = sizeof(LOG_STRINGS) / sizeof(LOG_STRINGS[0]);
+
+// The string escaping used before the word-at-a-time scan
+static void write_string_bytewise(rbjson::Writer& w, const char* str, size_t len) {
+    const char* start = str;
+    const char* const end = str + len;
+
+    w.put('"');
+    for (const char* itr = str; itr != end; ++itr) {
+        char escaped;
+        switch (*itr) {
+        case '"':
+        case '\\':
+            escaped = *itr;
+            break;
+        case '\b':
+            escaped = 'b';
+            break;
+        case '\f':
+            escaped = 'f';
+            break;
+        case '\n':
+            escaped = 'n';
+            break;
+        case '\r':
+            escaped = 'r';
+            break;
+        case '\t':
+            escaped = 't';
+            break;
+        default:
+            continue;
+        }
+
+        w.write(start, itr - start);
+        w.put('\\');
+        w.put(escaped);
+        start = itr + 1;
+    }
+    w.write(start, end - start);
+    w.put('"');
+}
+
+static void bench_string_escape() {
+    size_t lens[LOG_STRINGS_COUNT];
+    size_t total = 0;
+    for (size_t i = 0; i < LOG_STRINGS_COUNT; ++i) {
+        lens[i] = strlen(LOG_STRINGS[i]);
+        total += lens[i];
+    }
+    printf("\n== String escaping, %u log messages, %u bytes on average ==\n",
+        (unsigned)LOG_STRINGS_COUNT, (unsigned)(total / LOG_STRINGS_COUNT));
+
+    char buf[1024];
+    bench("byte by byte", 20000, [&](uint32_t i) {
+        rbjson::Writer w(buf, sizeof(buf));
+        write_string_bytewise(w, LOG_STRINGS[i % LOG_STRINGS_COUNT], lens[i % LOG_STRINGS_COUNT]);
+        g_sink += w.size();
+    });
+
+    bench("rbjson::Writer::writeString", 20000, [&](uint32_t i) {
+        rbjson::Writer w(buf, sizeof(buf));
+        w.writeString(LOG_STRINGS[i % LOG_STRINGS_COUNT], lens[i % LOG_STRINGS_COUNT]);
+        g_sink += w.size();
+    });
+}
+
+// A "joy" packet as sent by the RBController app with two joysticks
+static const char JOY_PACKET[] = "{\"c\":\"joy\",\"n\":1234,\"data\":[{\"x\":-12345,\"y\":32767},{\"x\":0,\"y\":-5}]}";
+
+// A state packet with decimals
+static const char STATE_PACKET[] = "{\"c\":\"state\",\"n\":5678,\"bat\":7.42,\"speed\":[0.125,-1.5,33.75],\"pid\":{\"p\":1.2,\"i\":0.05,\"d\":0.001}}";
+
+struct JoyAxis {
+    int32_t x;
+    int32_t y;
+};
+RBJSON_BIND(JoyAxis, rbjson::field("x", &JoyAxis::x), rbjson::field("y", &JoyAxis::y))
+
+struct JoyPacket {
+    const char* c;
+    int32_t n;
+    JoyAxis data[2];
+};
+RBJSON_BIND(JoyPacket, rbjson::field("c", &JoyPacket::c), rbjson::field("n", &JoyPacket::n), rbjson::field("data", &JoyPacket::data))
+
+static const char* const LITERALS[] = {
+    "1234", "-12345", "32767", "0", "-5", "7.42", "0.125", "-1.5", "33.75", "0.001",
+};
+static const size_t LITERALS_COUNT = sizeof(LITERALS) / sizeof(LITERALS[0]);
+
+// The number parsing used before rbjson::parseNumber
+static double parse_number_strtod(const char* str, size_t len) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*s", (int)len, str);
+    return strtod(buf, NULL);
+}
+
+static void bench_number_parse() {
+    printf("\n== Number parsing, %u literals from joy and state packets ==\n", (unsigned)LITERALS_COUNT);
+
+    size_t lens[LITERALS_COUNT];
+    for (size_t i = 0; i < LITERALS_COUNT; ++i) {
+        lens[i] = strlen(LITERALS[i]);
+    }
+
+    bench("snprintf + strtod", 20000, [&](uint32_t i) {
+        g_sink += (size_t)parse_number_strtod(LITERALS[i % LITERALS_COUNT], lens[i % LITERALS_COUNT]);
+    });
+
+    bench("rbjson::parseNumber", 20000, [&](uint32_t i) {
+        rbjson::Number num;
+        rbjson::parseNumber(LITERALS[i % LITERALS_COUNT], lens[i % LITERALS_COUNT], num);
+        g_sink += (size_t)num.getInt();
+    });
+}
+
+static void bench_parse_packet(const char* name, const char* packet) {
+    printf("\n== Parsing %s packet, %u bytes ==\n", name, (unsigned)strlen(packet));
+
+    const size_t len = strlen(packet);
+    char buf[256];
+    rbjson::Arena arena;
+
+    bench("rbjson::parse", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        delete rbjson::parse(buf, len);
+    });
+
+    size_t tree_bytes = 0;
+    bench("rbjson::parse, arena + borrowed strings", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        rbjson::parse(buf, len, arena, rbjson::PARSE_BORROW_STRINGS);
+        tree_bytes = arena.used();
+        arena.reset();
+    });
+
+    bench("rbjson::parse, lazy, read \"c\" and \"n\"", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        rbjson::Object* pkt = rbjson::parse(buf, len, arena, rbjson::PARSE_BORROW_STRINGS | rbjson::PARSE_LAZY);
+        g_sink += pkt->getInt("n") + pkt->getStringView("c").data()[0];
+        arena.reset();
+    });
+
+    rbjson::TokenPool tokens;
+    size_t nodes_bytes = 0;
+    bench("rbjson::parseNodes, borrowed strings", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        rbjson::parseNodes(buf, len, arena, tokens, rbjson::PARSE_BORROW_STRINGS);
+        nodes_bytes = arena.used();
+        arena.reset();
+    });
+
+    size_t tape_bytes = 0;
+    bench("rbjson::Document", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        rbjson::Document doc(tokens, arena);
+        doc.parse(buf, len);
+        tape_bytes = arena.used();
+        arena.reset();
+    });
+    printf("arena bytes: Value tree %u, Node tree %u, Document tape %u\n",
+        (unsigned)tree_bytes, (unsigned)nodes_bytes, (unsigned)tape_bytes);
+
+    rbjson::Reader reader(tokens);
+    bench("rbjson::Reader, read \"c\" and \"n\"", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        reader.parse(buf, len);
+        g_sink += reader.getInt("n") + reader.getString("c")[0];
+    });
+
+    struct SumHandler : public rbjson::Handler {
+        bool number(const rbjson::Number& value) {
+            sum += value.get();
+            return true;
+        }
+
+        double sum = 0;
+    } handler;
+    bench("rbjson::Reader, visit all values", 5000, [&](uint32_t i) {
+        memcpy(buf, packet, len);
+        reader.parse(buf, len);
+        reader.visit(handler);
+    });
+    g_sink += size_t(handler.sum);
+}
+
+// A log packet with long strings and a sample array, as a host would send in bulk
+static size_t make_log_packet(char* buf, size_t capacity) {
+    rbjson::Writer w(buf, capacity);
+    w.write("{\"c\":\"log\",\"n\":42,\"msgs\":[", 26);
+    for (size_t i = 0; i < LOG_STRINGS_COUNT; ++i) {
+        if (i != 0) {
+            w.put(',');
+        }
+        w.writeString(LOG_STRINGS[i], strlen(LOG_STRINGS[i]));
+    }
+    w.write("],\"samples\":[", 13);
+    char num[RBJSON_NUMBER_MAX_LEN];
+    for (size_t i = 0; i < 4 * NUMBERS_COUNT; ++i) {
+        if (i != 0) {
+            w.put(',');
+        }
+        w.write(num, rbjson::formatDouble(num, NUMBERS[i % NUMBERS_COUNT] * (i + 1)));
+    }
+    w.write("]}", 2);
+    return w.size();
+}
+
+static void bench_tokenize(const char* name, const char* packet, size_t len) {
+    printf("\n== Tokenizing %s packet, %u bytes ==\n", name, (unsigned)len);
+
+    jsmntok_t tokens[128];
+    bench("jsmn_parse", 5000, [&](uint32_t i) {
+        jsmn_parser parser;
+        jsmn_init(&parser);
+        g_sink += jsmn_parse(&parser, packet, len, tokens, 128);
+    });
+
+    bench("rbjson::scanTokens", 5000, [&](uint32_t i) {
+        g_sink += rbjson::scanTokens(packet, len, tokens, 128);
+    });
+}
+
+// The fast paths are checked against the reference ones before anything is timed,
+// a benchmark of wrong results is worthless
+static void check(bool ok, const char* what, const char* detail) {
+    if (!ok) {
+        printf("MISMATCH in %s: %s\n", what, detail);
+        abort();
+    }
+}
+
+static void check_numbers() {
+    char buf[RBJSON_NUMBER_MAX_LEN + 1];
+    rbjson::Number num;
+
+    // Values with up to RBJSON_NUMBER_DECIMALS decimals must come back bit-exact, and the same as from strtod
+    for (int32_t i = -1000000; i <= 1000000; i += 7) {
+        const double value = i / 10000.0;
+        const size_t len = rbjson::formatDouble(buf, value);
+        buf[len] = 0;
+        check(rbjson::parseNumber(buf, len, num) && num.get() == value && num.get() == strtod(buf, NULL),
+            "formatDouble/parseNumber round-trip", buf);
+    }
+
+    for (size_t i = 0; i < NUMBERS_COUNT; ++i) {
+        const size_t len = rbjson::formatDouble(buf, NUMBERS[i]);
+        buf[len] = 0;
+        check(rbjson::parseNumber(buf, len, num) && fabs(num.get() - NUMBERS[i]) <= 0.00005 + 1e-9,
+            "formatDouble/parseNumber round-trip", buf);
+    }
+
+    const int64_t ints[] = { 0, 1, -1, 9, 10, -10, 32767, -32768, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN };
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); ++i) {
+        const size_t len = rbjson::formatInt(buf, ints[i]);
+        buf[len] = 0;
+        check(rbjson::parseNumber(buf, len, num) && num.isInt() && num.getInt() == ints[i], "formatInt/parseNumber round-trip", buf);
+    }
+
+    for (size_t i = 0; i < LITERALS_COUNT; ++i) {
+        const size_t len = strlen(LITERALS[i]);
+        check(rbjson::parseNumber(LITERALS[i], len, num) && num.get() == parse_number_strtod(LITERALS[i], len),
+            "parseNumber against strtod", LITERALS[i]);
+    }
+}
+
+static void check_unescape() {
+    static const char PACKET[] = "{\"s\":\"a\\u00e9\\ud83d\\ude00\\n\\\"\\/b\\u0041\"}";
+    static const char EXPECTED[] = "a\xc3\xa9\xf0\x9f\x98\x80\n\"/bA";
+
+    const size_t len = strlen(PACKET);
+    char buf[sizeof(PACKET)];
+    rbjson::Arena arena;
+    rbjson::TokenPool tokens;
+
+    memcpy(buf, PACKET, len);
+    rbjson::Object* heap = rbjson::parse(buf, len);
+    check(heap != NULL && heap->getString("s") == EXPECTED, "\\u unescaping", "rbjson::parse");
+    delete heap;
+
+    memcpy(buf, PACKET, len);
+    rbjson::Object* borrowed = rbjson::parse(buf, len, arena, rbjson::PARSE_BORROW_STRINGS);
+    check(borrowed != NULL && borrowed->getString("s") == EXPECTED, "\\u unescaping", "rbjson::parse, borrowed strings");
+    arena.reset();
+
+    memcpy(buf, PACKET, len);
+    rbjson::Document doc(tokens, arena);
+    check(doc.parse(buf, len) && doc.getString("s") == EXPECTED, "\\u unescaping", "rbjson::Document");
+}
+
+static void check_tokens(const char* name, const char* packet, size_t len) {
+    jsmntok_t expected[128];
+    jsmntok_t tokens[128];
+
+    jsmn_parser parser;
+    jsmn_init(&parser);
+    const int count = jsmn_parse(&parser, packet, len, expected, 128);
+    check(rbjson::scanTokens(packet, len, tokens, 128) == count && rbjson::scanTokens(packet, len, NULL, 0) == count,
+        "scanTokens token count", name);
+    for (int i = 0; i < count; ++i) {
+        check(tokens[i].type == expected[i].type && tokens[i].start == expected[i].start
+                && tokens[i].end == expected[i].end && tokens[i].size == expected[i].size,
+            "scanTokens against jsmn_parse", name);
+    }
+}
+
+static void check_parse(const char* name, const char* packet, size_t len) {
+    char buf[1024];
+    rbjson::Arena arena;
+    rbjson::TokenPool tokens;
+
+    memcpy(buf, packet, len);
+    rbjson::Object* ref = rbjson::parse(buf, len);
+    check(ref != NULL, "rbjson::parse", name);
+    const std::string expected = ref->str();
+    delete ref;
+
+    memcpy(buf, packet, len);
+    rbjson::Object* borrowed = rbjson::parse(buf, len, arena, tokens, rbjson::PARSE_BORROW_STRINGS);
+    check(borrowed != NULL && borrowed->str() == expected, "parse with borrowed strings against parse()", name);
+    arena.reset();
+
+    memcpy(buf, packet, len);
+    rbjson::Object* lazy = rbjson::parse(buf, len, arena, rbjson::PARSE_BORROW_STRINGS | rbjson::PARSE_LAZY);
+    check(lazy != NULL && lazy->str() == expected, "lazy parse against parse()", name);
+    arena.reset();
+
+    // The tape keeps the message order, so its output goes through parse() to get sorted keys
+    memcpy(buf, packet, len);
+    rbjson::Document doc(tokens, arena);
+    check(doc.parse(buf, len), "rbjson::Document", name);
+    std::string doc_json = doc.root().str();
+    rbjson::Object* reparsed = rbjson::parse(&doc_json[0], doc_json.size());
+    check(reparsed != NULL && reparsed->str() == expected, "rbjson::Document against parse()", name);
+    delete reparsed;
+    arena.reset();
+
+    // Rebuilt from a different layout first, then updated in place
+    rbjson::Object target;
+    target.set("other", 1);
+    for (int round = 0; round < 2; ++round) {
+        memcpy(buf, packet, len);
+        check(rbjson::parseInto(target, buf, len) && target.str() == expected, "parseInto against parse()", name);
+    }
+}
+
+struct QueueProducer {
+    rb::internal::SendQueue* queue;
+    SemaphoreHandle_t done;
+    uint16_t id;
+};
+
+static const int QUEUE_CHECK_PRODUCERS = 4;
+static const int16_t QUEUE_CHECK_ITEMS = 5000;
+
+static void queue_producer_task(void* arg) {
+    const QueueProducer& producer = *(const QueueProducer*)arg;
+    bool was_empty;
+    for (int16_t i = 0; i < QUEUE_CHECK_ITEMS; ++i) {
+        rb::internal::QueueItem item;
+        memset(&item, 0, sizeof(item));
+        item.size = producer.id;
+        item.slot = i;
+        while (!producer.queue->push(item, was_empty)) {
+            taskYIELD();
+        }
+    }
+    xSemaphoreGive(producer.done);
+    vTaskDelete(nullptr);
+}
+
+static void check_send_queue() {
+    // Small, so that the producers keep running into a full queue
+    rb::internal::SendQueue queue(8);
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(QUEUE_CHECK_PRODUCERS, 0);
+
+    QueueProducer producers[QUEUE_CHECK_PRODUCERS];
+    int16_t next[QUEUE_CHECK_PRODUCERS];
+    for (int i = 0; i < QUEUE_CHECK_PRODUCERS; ++i) {
+        producers[i] = QueueProducer { &queue, done, uint16_t(i) };
+        next[i] = 0;
+        xTaskCreate(&queue_producer_task, "queue_check", 2048, &producers[i], 1, NULL);
+    }
+
+    // Every item must arrive exactly once and in the order its producer pushed it
+    rb::internal::QueueItem item;
+    for (int received = 0; received < QUEUE_CHECK_PRODUCERS * QUEUE_CHECK_ITEMS;) {
+        if (!queue.pop(item)) {
+            taskYIELD();
+            continue;
+        }
+        check(item.size < QUEUE_CHECK_PRODUCERS && item.slot == next[item.size], "SendQueue under contention", "item lost, repeated or reordered");
+        ++next[item.size];
+        ++received;
+    }
+
+    for (int i = 0; i < QUEUE_CHECK_PRODUCERS; ++i) {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    vSemaphoreDelete(done);
+    check(queue.size() == 0 && !queue.pop(item), "SendQueue under contention", "extra items");
+}
+
+static void check_results(const char* log_packet, size_t log_len) {
+    printf("\n== Checking results ==\n");
+
+    // Arrays, escapes and literals that the packets below do not have
+    static const char EDGE_PACKET[] = "{\"a\":[],\"b\":{},\"c\":\"x\\\"y\\\\\",\"d\":[true,false,null,-1.5e3,0],\"e\":{\"f\":[[1],[2,{\"g\":\"\"}]]}}";
+
+    check_numbers();
+    check_unescape();
+
+    const char* const names[] = { "joy", "state", "log", "edge" };
+    const char* const packets[] = { JOY_PACKET, STATE_PACKET, log_packet, EDGE_PACKET };
+    const size_t lens[] = { strlen(JOY_PACKET), strlen(STATE_PACKET), log_len, strlen(EDGE_PACKET) };
+    for (size_t i = 0; i < sizeof(packets) / sizeof(packets[0]); ++i) {
+        check_tokens(names[i], packets[i], lens[i]);
+        check_parse(names[i], packets[i], lens[i]);
+    }
+
+    check_send_queue();
+    printf("all results match\n");
+}
+
+static void bench_joy_access() {
+    printf("\n== Reading all joy axes ==\n");
+
+    const size_t len = strlen(JOY_PACKET);
+    char buf[256];
+    rbjson::Arena arena;
+    rbjson::TokenPool tokens;
+    rbjson::Reader reader(tokens);
+
+    bench("rbjson::parse + getArray/getObject/getInt", 5000, [&](uint32_t i) {
+        memcpy(buf, JOY_PACKET, len);
+        rbjson::Object* pkt = rbjson::parse(buf, len, arena, tokens, rbjson::PARSE_BORROW_STRINGS);
+        rbjson::Array* data = pkt->getArray("data");
+        for (size_t a = 0; a < data->size(); ++a) {
+            rbjson::Object* axis = data->getObject(a);
+            g_sink += axis->getInt("x") + axis->getInt("y");
+        }
+        arena.reset();
+    });
+
+    rbjson::Object joy;
+    bench("rbjson::parseInto, same layout + getInt", 5000, [&](uint32_t i) {
+        memcpy(buf, JOY_PACKET, len);
+        rbjson::parseInto(joy, buf, len, rbjson::PARSE_BORROW_STRINGS);
+        rbjson::Array* data = joy.getArray("data");
+        for (size_t a = 0; a < data->size(); ++a) {
+            rbjson::Object* axis = data->getObject(a);
+            g_sink += axis->getInt("x") + axis->getInt("y");
+        }
+    });
+
+    bench("rbjson::parseNodes + getArray/at/getInt", 5000, [&](uint32_t i) {
+        memcpy(buf, JOY_PACKET, len);
+        const rbjson::Node* pkt = rbjson::parseNodes(buf, len, arena, tokens, rbjson::PARSE_BORROW_STRINGS);
+        const rbjson::Node* data = pkt->getArray("data");
+        for (size_t a = 0; a < data->size(); ++a) {
+            const rbjson::Node* axis = data->at(a);
+            g_sink += axis->getInt("x") + axis->getInt("y");
+        }
+        arena.reset();
+    });
+
+    bench("rbjson::Document + getArray/at/getInt", 5000, [&](uint32_t i) {
+        memcpy(buf, JOY_PACKET, len);
+        rbjson::Document doc(tokens, arena);
+        doc.parse(buf, len);
+        const rbjson::Element data = doc.getArray("data");
+        for (size_t a = 0; a < data.size(); ++a) {
+            const rbjson::Element axis = data.at(a);
+            g_sink += axis.getInt("x") + axis.getInt("y");
+        }
+        arena.reset();
+    });
+
+    bench("rbjson::decode into a bound struct", 5000, [&](uint32_t i) {
+        memcpy(buf, JOY_PACKET, len);
+        reader.parse(buf, len);
+        JoyPacket pkt;
+        rbjson::decode(reader, pkt);
+        for (const auto& axis : pkt.data) {
+            g_sink += axis.x + axis.y;
+        }
+    });
+
+    JoyPacket pkt = { "joy", 1234, { { -12345, 32767 }, { 0, -5 } } };
+    bench("rbjson::encode a bound struct", 5000, [&](uint32_t i) {
+        rbjson::Writer w(buf, sizeof(buf));
+        rbjson::encode(w, pkt);
+        g_sink += w.size();
+    });
+}
+
+static volatile int64_t g_joy_received_at;
+static volatile bool g_joy_slow;
+
+static void bench_recv_latency() {
+    printf("\n== Receive latency of joy packets over loopback UDP ==\n");
+
+    // Loopback needs just the TCP/IP stack, no WiFi
+#ifdef RBPROTOCOL_USE_NETIF
+    esp_netif_init();
+#else
+    tcpip_adapter_init();
+#endif
+
+    rb::Protocol prot("rbjson", "benchmark", "receive latency", [](const std::string& cmd, rbjson::Object* pkt) {
+        if (cmd == "joy") {
+            g_joy_received_at = esp_timer_get_time();
+            // Handling that takes a while, e.g. driving motors over a bus
+            while (g_joy_slow && esp_timer_get_time() - g_joy_received_at < 1000) {
+            }
+        }
+    });
+
+    rb::ProtocolConfig cfg = rb::Protocol::DEFAULT_CONFIG;
+    cfg.enable_ws = false;
+    cfg.udp_port = 42425;
+    if (prot.start(cfg) != ESP_OK) {
+        printf("failed to start the protocol\n");
+        return;
+    }
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg.udp_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const char possess[] = "{\"c\":\"possess\",\"n\":-1}";
+    sendto(fd, possess, sizeof(possess) - 1, 0, (struct sockaddr*)&addr, sizeof(addr));
+    vTaskDelay(pdMS_TO_TICKS(50));
+
+    const int count = 50;
+    int received = 0;
+    int64_t total = 0;
+    int64_t worst = 0;
+    char pkt[128];
+    for (int i = 0; i < count; ++i) {
+        const int len = snprintf(pkt, sizeof(pkt), "{\"c\":\"joy\",\"n\":%d,\"data\":[{\"x\":%d,\"y\":0}]}", i + 1, i);
+        g_joy_received_at = 0;
+        const int64_t sent_at = esp_timer_get_time();
+        sendto(fd, pkt, len, 0, (struct sockaddr*)&addr, sizeof(addr));
+
+        // Busy wait, so that the packets do not all arrive right after a tick like vTaskDelay would make them
+        const int64_t next_at = sent_at + 20000 + (i * 3331) % 10000;
+        while (esp_timer_get_time() < next_at) {
+        }
+
+        if (g_joy_received_at != 0) {
+            const int64_t latency = g_joy_received_at - sent_at;
+            total += latency;
+            worst = latency > worst ? latency : worst;
+            ++received;
+        }
+    }
+    printf("%d of %d packets received, %.1f us on average, %lld us worst\n",
+        received, count, received ? double(total) / received : 0.0, (long long)worst);
+
+    // A burst, as when the app catches up after a WiFi hiccup, with 1 ms of work per packet
+    g_joy_slow = true;
+    const rb::ProtocolRecvStats before = prot.get_recv_stats();
+    for (int i = 0; i < count; ++i) {
+        const int len = snprintf(pkt, sizeof(pkt), "{\"c\":\"joy\",\"n\":%d,\"data\":[{\"x\":%d,\"y\":0}]}", count + i + 1, i);
+        sendto(fd, pkt, len, 0, (struct sockaddr*)&addr, sizeof(addr));
+    }
+    vTaskDelay(pdMS_TO_TICKS(200));
+    g_joy_slow = false;
+    const rb::ProtocolRecvStats after = prot.get_recv_stats();
+    const uint32_t batches = after.batches - before.batches;
+    printf("burst of %d packets: %u received in %u batches, %.1f per batch on average, %u at most\n",
+        count, (unsigned)(after.messages - before.messages), (unsigned)batches,
+        batches ? double(after.messages - before.messages) / batches : 0.0, (unsigned)after.max_batch);
+
+    close(fd);
+    prot.stop();
+}
+
+// Appends a masked text frame, as browsers send them
+static void append_ws_frame(std::string& out, const char* payload, size_t len) {
+    static const uint8_t MASK[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+    out.push_back(char(0x81)); // FIN, text
+    if (len < 126) {
+        out.push_back(char(0x80 | len));
+    } else {
+        out.push_back(char(0x80 | 126));
+        out.push_back(char(len >> 8));
+        out.push_back(char(len & 0xFF));
+    }
+    out.append((const char*)MASK, sizeof(MASK));
+    for (size_t i = 0; i < len; ++i) {
+        out.push_back(char(payload[i] ^ MASK[i % 4]));
+    }
+}
+
+static void bench_ws_burst() {
+    printf("\n== Burst of joy packets over a loopback WebSocket ==\n");
+
+    const int port = 42427;
+    TaskHandle_t web = rb_web_start_no_spiffs(port, "/");
+
+    static volatile int joys;
+    joys = 0;
+    rb::Protocol prot("rbjson", "benchmark", "ws burst", [](const std::string& cmd, rbjson::Object* pkt) {
+        if (cmd == "joy") {
+            ++joys;
+        }
+    });
+
+    rb::ProtocolConfig cfg = rb::Protocol::DEFAULT_CONFIG;
+    cfg.enable_udp = false;
+    if (prot.start(cfg) != ESP_OK) {
+        printf("failed to start the protocol\n");
+        rb_web_stop(web);
+        return;
+    }
+
+    const int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // The server reads the request through its own buffer, so nothing else may be sent before its response
+    static const char UPGRADE[] = "GET / HTTP/1.1\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n\r\n";
+    char resp[256];
+    size_t resp_len = 0;
+    bool upgraded = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && send(fd, UPGRADE, sizeof(UPGRADE) - 1, 0) == int(sizeof(UPGRADE) - 1);
+    while (upgraded && resp_len < sizeof(resp) - 1) {
+        const int n = recv(fd, resp + resp_len, sizeof(resp) - 1 - resp_len, 0);
+        if (n <= 0) {
+            upgraded = false;
+            break;
+        }
+        resp_len += n;
+        resp[resp_len] = 0;
+        if (strstr(resp, "\r\n\r\n") != NULL) {
+            upgraded = strstr(resp, " 101 ") != NULL;
+            break;
+        }
+    }
+    if (!upgraded) {
+        printf("WebSocket upgrade failed\n");
+        close(fd);
+        prot.stop();
+        rb_web_stop(web);
+        return;
+    }
+
+    std::string frames;
+    const char possess[] = "{\"c\":\"possess\",\"n\":-1}";
+    append_ws_frame(frames, possess, sizeof(possess) - 1);
+    send(fd, frames.data(), frames.size(), 0);
+    vTaskDelay(pdMS_TO_TICKS(50));
+
+    // All frames in one write, so they are all in the socket when the receive task wakes up
+    const int count = 50;
+    char pkt[128];
+    frames.clear();
+    for (int i = 0; i < count; ++i) {
+        const int len = snprintf(pkt, sizeof(pkt), "{\"c\":\"joy\",\"n\":%d,\"data\":[{\"x\":%d,\"y\":0}]}", i + 1, i);
+        append_ws_frame(frames, pkt, len);
+    }
+
+    const rb::ProtocolRecvStats before = prot.get_recv_stats();
+    send(fd, frames.data(), frames.size(), 0);
+    for (int i = 0; i < 100 && joys < count; ++i) {
+        vTaskDelay(pdMS_TO_TICKS(2));
+    }
+    const rb::ProtocolRecvStats after = prot.get_recv_stats();
+    const uint32_t batches = after.batches - before.batches;
+    printf("burst of %d frames: %d received in %u batches, %.1f per batch on average, %u at most\n",
+        count, joys, (unsigned)batches, batches ? double(after.messages - before.messages) / batches : 0.0,
+        (unsigned)after.max_batch);
+
+    // The protocol closes its side first, fd has unread responses and closing it would reset the connection
+    prot.stop();
+    close(fd);
+    rb_web_stop(web);
+}
+
+static void bench_send_state(const char* name, uint16_t send_buffer_count, bool use_try_send) {
+    rb::Protocol prot("rbjson", "benchmark", "send");
+    rb::ProtocolConfig cfg = rb::Protocol::DEFAULT_CONFIG;
+    cfg.enable_ws = false;
+    cfg.udp_port = 42426;
+    cfg.send_buffer_count = send_buffer_count;
+    if (prot.start(cfg) != ESP_OK) {
+        printf("failed to start the protocol\n");
+        return;
+    }
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg.udp_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const char possess[] = "{\"c\":\"possess\",\"n\":-1}";
+    sendto(fd, possess, sizeof(possess) - 1, 0, (struct sockaddr*)&addr, sizeof(addr));
+    vTaskDelay(pdMS_TO_TICKS(50));
+
+    rbjson::Object state;
+    state.set("bat", 7.42);
+    rbjson::Array* speed = new rbjson::Array();
+    speed->push_back(new rbjson::Number(0.125));
+    speed->push_back(new rbjson::Number(-1.5));
+    speed->push_back(new rbjson::Number(33.75));
+    state.set("speed", speed);
+    rbjson::Object* pid = new rbjson::Object();
+    pid->set("p", 1.2);
+    pid->set("i", 0.05);
+    pid->set("d", 0.001);
+    state.set("pid", pid);
+
+    // Bursts shorter than the pool, the send task empties the queue in between
+    const int rounds = 100;
+    const int burst = 8;
+    int64_t elapsed = 0;
+    for (int i = 0; i < rounds; ++i) {
+        const int64_t start = esp_timer_get_time();
+        for (int j = 0; j < burst; ++j) {
+            if (use_try_send) {
+                prot.try_send("state", &state);
+            } else {
+                prot.send("state", &state);
+            }
+        }
+        elapsed += esp_timer_get_time() - start;
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    printf("%-44s %7u iterations %10.1f ns/op\n", name, (unsigned)(rounds * burst), double(elapsed) * 1000.0 / (rounds * burst));
+    if (use_try_send) {
+        const rb::ProtocolSendStats stats = prot.get_send_stats();
+        printf("send queue of %u: %u deep at most, %u of %u buffers used at most, %u dropped\n", (unsigned)stats.capacity,
+            (unsigned)stats.high_watermark, (unsigned)stats.buffers_high_watermark, (unsigned)stats.buffers, (unsigned)stats.dropped);
+    }
+
+    close(fd);
+    prot.stop();
+}
+
+static void bench_mustarrive_resend() {
+    printf("\n== Must-arrive resend of a log packet ==\n");
+
+    rbjson::Object pkt;
+    pkt.set(rbjson::KEY_C, "log");
+    pkt.set(rbjson::KEY_E, 3);
+    pkt.set(rbjson::KEY_MSG, LOG_STRINGS[1]);
+
+    // What resend_mustarrive_locked() did before the packets were kept serialized
+    bench("set \"n\" + serialize", 20000, [&](uint32_t i) {
+        pkt.set(rbjson::KEY_N, int(i));
+        rbjson::Writer w;
+        pkt.serialize(w);
+        g_sink += w.size();
+    });
+
+    // And what it does now, rewriting the space-padded "n" slot in front of the cached bytes
+    pkt.remove(rbjson::KEY_N);
+    uint16_t size;
+    char* cached = rb::internal::serialize_mustarrive(&pkt, size);
+    bench("rewrite \"n\" in the cached packet", 20000, [&](uint32_t i) {
+        rb::internal::write_mustarrive_n(cached, int(i));
+        g_sink += cached[MUST_ARRIVE_N_OFFSET] + size;
+    });
+    delete[] cached;
+}
+
+static void bench_send() {
+    printf("\n== Protocol::send of a state packet ==\n");
+    bench_send_state("heap buffer per message", 0, false);
+    bench_send_state("pooled send buffers", rb::Protocol::DEFAULT_CONFIG.send_buffer_count, false);
+    bench_send_state("pooled send buffers, try_send", rb::Protocol::DEFAULT_CONFIG.send_buffer_count, true);
+}
+
+void setup() {
+    printf("rbjson benchmarks\n");
+
+    char log_packet[1024];
+    const size_t log_len = make_log_packet(log_packet, sizeof(log_packet));
+    check_results(log_packet, log_len);
+
+    bench_number_format();
+    bench_number_parse();
+    bench_string_escape();
+    bench_parse_packet("joy", JOY_PACKET);
+    bench_parse_packet("state", STATE_PACKET);
+    bench_tokenize("joy", JOY_PACKET, strlen(JOY_PACKET));
+    bench_tokenize("state", STATE_PACKET, strlen(STATE_PACKET));
+    bench_tokenize("log", log_packet, log_len);
+    bench_joy_access();
+    bench_recv_latency();
+    bench_ws_burst();
+    bench_send();
+    bench_mustarrive_resend();
+
+    printf("\ndone\n");
+}
+
+void loop() {
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+}
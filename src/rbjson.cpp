@@ -10,231 +10,2010 @@
 #include "./jsmn.h"
 #include "rbjson.h"
 
-#include "mpaland-printf/printf.h"
+#define TAG "RbJson"
+
+namespace rbjson {
+
+template <typename T, typename... Args>
+static T* make_value(Arena* arena, Args&&... args) {
+    if (arena) {
+        return arena->make<T>(std::forward<Args>(args)...);
+    }
+    return new T(std::forward<Args>(args)...);
+}
+
+struct parse_ctx {
+    char* buf;
+    Arena* arena;
+    TokenPool* pool;
+    uint8_t flags;
+};
+
+static bool read_hex4(const char* str, const char* end, uint32_t& out) {
+    if (end - str < 4) {
+        return false;
+    }
+
+    out = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char c = str[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        out = (out << 4) | digit;
+    }
+    return true;
+}
+
+static char* write_utf8(char* out, uint32_t cp) {
+    if (cp < 0x80) {
+        *out++ = cp;
+    } else if (cp < 0x800) {
+        *out++ = 0xC0 | (cp >> 6);
+        *out++ = 0x80 | (cp & 0x3F);
+    } else if (cp < 0x10000) {
+        *out++ = 0xE0 | (cp >> 12);
+        *out++ = 0x80 | ((cp >> 6) & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    } else {
+        *out++ = 0xF0 | (cp >> 18);
+        *out++ = 0x80 | ((cp >> 12) & 0x3F);
+        *out++ = 0x80 | ((cp >> 6) & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    }
+    return out;
+}
+
+// Decodes the \uXXXX sequence whose hex digits start at src to UTF-8, together with
+// the low half of a surrogate pair. Lone surrogates become U+FFFD.
+// Returns the end of the consumed input, NULL if the digits are malformed.
+static const char* unescape_unicode(const char* src, const char* end, char*& out) {
+    uint32_t cp;
+    if (!read_hex4(src, end, cp)) {
+        return NULL;
+    }
+    src += 4;
+
+    if (cp >= 0xD800 && cp < 0xDC00) {
+        uint32_t low;
+        if (end - src >= 6 && src[0] == '\\' && src[1] == 'u' && read_hex4(src + 2, end, low)
+            && low >= 0xDC00 && low < 0xE000) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            src += 6;
+        } else {
+            cp = 0xFFFD;
+        }
+    } else if (cp >= 0xDC00 && cp < 0xE000) {
+        cp = 0xFFFD;
+    }
+
+    out = write_utf8(out, cp);
+    return src;
+}
+
+// Decodes the escape sequences of len bytes at src to dst and returns the decoded length.
+// dst may be the same as src, the output is never longer than the input.
+// Runs without a backslash are moved as a whole.
+static size_t unescape(char* dst, const char* src, size_t len) {
+    const char* const end = src + len;
+    char* out = dst;
+    while (true) {
+        const char* esc = (const char*)memchr(src, '\\', end - src);
+        const char* const run_end = esc ? esc : end;
+        if (out != src) {
+            memmove(out, src, run_end - src);
+        }
+        out += run_end - src;
+        src = run_end;
+
+        if (esc == NULL) {
+            break;
+        }
+
+        // A lone backslash at the end, jsmn does not let it through
+        if (++src == end) {
+            *out++ = '\\';
+            break;
+        }
+
+        const char c = *src++;
+        switch (c) {
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u': {
+            const char* next = unescape_unicode(src, end, out);
+            if (next == NULL) {
+                *out++ = '\\';
+                *out++ = 'u';
+            } else {
+                src = next;
+            }
+            break;
+        }
+        default: // \" \\ \/
+            *out++ = c;
+            break;
+        }
+    }
+    return out - dst;
+}
+
+static size_t unescape_in_place(char* str, size_t len) {
+    return unescape(str, str, len);
+}
+
+// Copies the string to the arena with its escapes decoded, the copy is \0 terminated
+static char* arena_unescape(Arena& arena, const char* str, size_t len, size_t& out_len) {
+    char* res = (char*)arena.alloc(len + 1, 1);
+    out_len = unescape(res, str, len);
+    res[out_len] = 0;
+    return res;
+}
+
+// Key of a copied member. Keys are rarely escaped, only those are decoded to a temporary buffer.
+struct decoded_key {
+    decoded_key(const char* raw, size_t raw_len)
+        : str(raw)
+        , len(raw_len) {
+        if (memchr(raw, '\\', raw_len) != NULL) {
+            buf.reset(new char[raw_len]);
+            len = unescape(buf.get(), raw, raw_len);
+            str = buf.get();
+        }
+    }
+
+    const char* str;
+    size_t len;
+    std::unique_ptr<char[]> buf;
+};
+
+// Internal parse flag, the strings were already decoded by decode_strings()
+static const uint8_t PARSE_STRINGS_DECODED = (1 << 7);
+
+static char* borrow_string(const parse_ctx& ctx, jsmntok_t* tok, size_t& out_len) {
+    char* str = ctx.buf + tok->start;
+    if (ctx.flags & PARSE_STRINGS_DECODED) {
+        out_len = tok->end - tok->start;
+        return str;
+    }
+
+    out_len = unescape_in_place(str, tok->end - tok->start);
+    // Overwrites at most the closing quote
+    str[out_len] = 0;
+    return str;
+}
+
+// Decodes all strings in place and moves their end to the decoded length
+static void decode_strings(char* buf, jsmntok_t* tokens, int count) {
+    for (int i = 0; i < count; ++i) {
+        jsmntok_t& tok = tokens[i];
+        if (tok.type == JSMN_STRING) {
+            char* str = buf + tok.start;
+            tok.end = tok.start + unescape_in_place(str, tok.end - tok.start);
+            // Overwrites at most the closing quote
+            str[tok.end - tok.start] = 0;
+        }
+    }
+}
+
+// Returns the index of the first token after the value at idx and all its children
+static int skip_value(const jsmntok_t* tokens, int idx, int count) {
+    int pending = 1;
+    while (pending > 0 && idx < count) {
+        pending += tokens[idx++].size - 1;
+    }
+    return idx;
+}
+
+static Value* parse_leaf(const parse_ctx& ctx, jsmntok_t* tok) {
+    switch (tok->type) {
+    case JSMN_STRING: {
+        if (ctx.flags & PARSE_BORROW_STRINGS) {
+            size_t len;
+            const char* str = borrow_string(ctx, tok, len);
+            return make_value<String>(ctx.arena, BORROW, str, len);
+        }
+
+        const char* str = ctx.buf + tok->start;
+        const size_t len = tok->end - tok->start;
+        if (ctx.arena) {
+            size_t decoded_len;
+            const char* decoded = arena_unescape(*ctx.arena, str, len, decoded_len);
+            return ctx.arena->make<String>(BORROW, decoded, decoded_len);
+        }
+        return new String(UNESCAPE, str, len);
+    }
+    case JSMN_PRIMITIVE: {
+        const char* str = ctx.buf + tok->start;
+        const int len = tok->end - tok->start;
+        if (len == 0) {
+            return NULL;
+        }
+
+        switch (*str) {
+        case 't':
+            return make_value<Bool>(ctx.arena, true);
+        case 'f':
+            return make_value<Bool>(ctx.arena, false);
+        case 'n':
+            return make_value<Nil>(ctx.arena);
+        default: {
+            Number num;
+            if (!parseNumber(str, len, num)) {
+                return NULL;
+            }
+            return make_value<Number>(ctx.arena, num);
+        }
+        }
+    }
+    default:
+        return NULL;
+    }
+}
+
+static void insert_member(const parse_ctx& ctx, Object* obj, jsmntok_t* key, Value* value) {
+    if (ctx.flags & PARSE_BORROW_STRINGS) {
+        size_t key_len;
+        const char* key_str = borrow_string(ctx, key, key_len);
+        obj->set(BORROW, key_str, key_len, value);
+    } else {
+        const decoded_key decoded(ctx.buf + key->start, key->end - key->start);
+        obj->set(decoded.str, decoded.len, value);
+    }
+}
+
+// True if all items of the array at idx are number literals
+static bool is_number_array(const parse_ctx& ctx, const jsmntok_t* tokens, int idx, int count) {
+    const int size = tokens[idx].size;
+    if (size < 2 || idx + size >= count) {
+        return false;
+    }
+
+    for (int i = idx + 1; i <= idx + size; ++i) {
+        const jsmntok_t& tok = tokens[i];
+        if (tok.type != JSMN_PRIMITIVE || tok.size != 0 || tok.end == tok.start) {
+            return false;
+        }
+        const char c = ctx.buf[tok.start];
+        if (c != '-' && (c < '0' || c > '9')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fills the array with its numbers in one contiguous block instead of a node per item
+static void parse_number_array(const parse_ctx& ctx, Array* arr, const jsmntok_t* tokens, int idx) {
+    const int size = tokens[idx].size;
+    Number* numbers = arr->allocNumbers(size);
+    for (int i = 0; i < size; ++i) {
+        const jsmntok_t& tok = tokens[idx + 1 + i];
+        if (parseNumber(ctx.buf + tok.start, tok.end - tok.start, numbers[i])) {
+            arr->push_back(&numbers[i]);
+        }
+    }
+}
+
+static int run_tokenizer(const char* buf, size_t size, jsmntok_t* tokens, size_t tokens_size) {
+#if RBJSON_FAST_SCAN
+    return scanTokens(buf, size, tokens, tokens_size);
+#else
+    jsmn_parser parser;
+    jsmn_init(&parser);
+    return jsmn_parse(&parser, buf, size, tokens, tokens_size);
+#endif
+}
+
+// Runs the tokenizer over buf. The tokens go to the passed-in buffer if they fit, to the pool if there is one,
+// or to tokens_dynamic otherwise. Returns the number of tokens or a negative jsmn error.
+static int tokenize(char* buf, size_t size, TokenPool* pool, jsmntok_t*& tokens, size_t tokens_size,
+    std::unique_ptr<jsmntok_t[]>& tokens_dynamic) {
+    // A pool that has already grown is tried right away, a big message is then tokenized only once
+    if (pool && pool->capacity() > tokens_size) {
+        tokens_size = pool->capacity();
+        tokens = pool->reserve(tokens_size);
+    }
+
+    int parsed = run_tokenizer(buf, size, tokens, tokens_size);
+    if (parsed == JSMN_ERROR_NOMEM) {
+        // Count the tokens first, so that the buffer is allocated and filled only once
+        const int needed = run_tokenizer(buf, size, NULL, 0);
+        const size_t limit = pool ? pool->maxTokens() : RBJSON_MAX_TOKENS;
+        if (needed > 0 && size_t(needed) > limit) {
+            ESP_LOGE(TAG, "failed to parse msg of %d bytes: too big, %d tokens over the limit of %d", (int)size, needed, (int)limit);
+            return JSMN_ERROR_NOMEM;
+        }
+
+        if (needed > 0) {
+            if (pool) {
+                tokens = pool->reserve(needed);
+            } else {
+                tokens_dynamic.reset(new jsmntok_t[needed]);
+                tokens = tokens_dynamic.get();
+            }
+            parsed = run_tokenizer(buf, size, tokens, needed);
+        } else {
+            parsed = needed;
+        }
+    }
+
+    if (parsed < 0) {
+        ESP_LOGE(TAG, "failed to parse msg %.*s: %d", size, buf, parsed);
+    }
+    return parsed;
+}
+
+// Source text of a PARSE_LAZY container, parsed on its first use
+struct LazySource {
+    char* buf;
+    uint32_t size;
+    uint8_t flags;
+
+    static void attach(const parse_ctx& ctx, Value* container, const jsmntok_t* tok);
+    static void load(Value* container, LazySource* src);
+};
+
+static bool fill_tree(const parse_ctx& ctx, jsmntok_t* tokens, int count, Value* root);
+
+void LazySource::attach(const parse_ctx& ctx, Value* container, const jsmntok_t* tok) {
+    auto* src = (LazySource*)ctx.arena->alloc(sizeof(LazySource), alignof(LazySource));
+    src->buf = ctx.buf + tok->start;
+    src->size = tok->end - tok->start;
+    src->flags = ctx.flags;
+
+    if (container->getType() == Value::OBJECT) {
+        ((Object*)container)->m_lazy = src;
+    } else {
+        ((Array*)container)->m_lazy = src;
+    }
+}
+
+void LazySource::load(Value* container, LazySource* src) {
+    jsmntok_t tokens_static[32];
+    std::unique_ptr<jsmntok_t[]> tokens_dynamic;
+    jsmntok_t* tokens = tokens_static;
+
+    const int parsed = tokenize(src->buf, src->size, NULL, tokens, 32, tokens_dynamic);
+    if (parsed <= 0) {
+        return;
+    }
+
+    Arena* arena = container->getType() == Value::OBJECT ? ((Object*)container)->arena() : ((Array*)container)->arena();
+    const parse_ctx ctx = { src->buf, arena, NULL, src->flags };
+    fill_tree(ctx, tokens, parsed, container);
+}
+
+void Object::load() const {
+    LazySource* src = m_lazy;
+    m_lazy = NULL;
+    LazySource::load(const_cast<Object*>(this), src);
+}
+
+void Array::load() const {
+    LazySource* src = m_lazy;
+    m_lazy = NULL;
+    LazySource::load(const_cast<Array*>(this), src);
+}
+
+// Builds the tree into root in a single forward pass over the tokens. Uses an explicit stack,
+// so deeply nested input cannot overflow the task's stack. Returns false if it is nested too deep.
+static bool fill_tree(const parse_ctx& ctx, jsmntok_t* tokens, int count, Value* root) {
+    struct Frame {
+        Value* container;
+        int remaining;
+    };
+
+    Frame stack[RBJSON_MAX_DEPTH];
+    int depth = 0;
+
+    if (root->getType() == Value::OBJECT) {
+        ((Object*)root)->reserve(tokens[0].size);
+    } else if (is_number_array(ctx, tokens, 0, count)) {
+        parse_number_array(ctx, (Array*)root, tokens, 0);
+        return true;
+    } else {
+        ((Array*)root)->reserve(tokens[0].size);
+    }
+    stack[depth++] = Frame { root, tokens[0].size };
+
+    int idx = 1;
+    while (depth > 0) {
+        Frame& top = stack[depth - 1];
+        if (top.remaining == 0 || idx >= count) {
+            --depth;
+            continue;
+        }
+        --top.remaining;
+
+        jsmntok_t* key = NULL;
+        if (top.container->getType() == Value::OBJECT) {
+            key = &tokens[idx];
+            if (key->type != JSMN_STRING || key->size != 1) {
+                idx = skip_value(tokens, idx, count);
+                continue;
+            }
+            ++idx;
+            if (idx >= count) {
+                break;
+            }
+        }
+
+        jsmntok_t* tok = &tokens[idx];
+        Value* val;
+        bool open = true;
+        if (tok->type == JSMN_OBJECT || tok->type == JSMN_ARRAY) {
+            if (depth == RBJSON_MAX_DEPTH) {
+                ESP_LOGE(TAG, "failed to parse msg: nested deeper than %d", RBJSON_MAX_DEPTH);
+                return false;
+            }
+
+            if (ctx.flags & PARSE_LAZY) {
+                val = tok->type == JSMN_OBJECT ? (Value*)ctx.arena->make<Object>() : (Value*)ctx.arena->make<Array>();
+                LazySource::attach(ctx, val, tok);
+                open = false;
+                idx = skip_value(tokens, idx, count);
+            } else if (tok->type == JSMN_OBJECT) {
+                auto* obj = make_value<Object>(ctx.arena);
+                obj->reserve(tok->size);
+                val = obj;
+                ++idx;
+            } else {
+                auto* arr = make_value<Array>(ctx.arena);
+                arr->reserve(tok->size);
+                val = arr;
+                if (is_number_array(ctx, tokens, idx, count)) {
+                    parse_number_array(ctx, arr, tokens, idx);
+                    open = false;
+                }
+                // The items of a number array are already parsed
+                idx += open ? 1 : tok->size + 1;
+            }
+        } else {
+            val = parse_leaf(ctx, tok);
+            idx = skip_value(tokens, idx, count);
+        }
+
+        if (val == NULL) {
+            continue;
+        }
+
+        if (key) {
+            insert_member(ctx, (Object*)top.container, key, val);
+        } else {
+            ((Array*)top.container)->push_back(val);
+        }
+
+        if (open && (val->getType() == Value::OBJECT || val->getType() == Value::ARRAY)) {
+            stack[depth++] = Frame { val, tok->size };
+        }
+    }
+    return true;
+}
+
+static Object* build_tree(const parse_ctx& ctx, jsmntok_t* tokens, int count) {
+    if (count == 0 || tokens[0].type != JSMN_OBJECT) {
+        return NULL;
+    }
+
+    Object* root = make_value<Object>(ctx.arena);
+    if (!fill_tree(ctx, tokens, count, root)) {
+        if (!ctx.arena) {
+            delete root;
+        }
+        return NULL;
+    }
+    return root;
+}
+
+// Overwrites the leaf value in place, returns false if it has a different type
+static bool update_leaf(const parse_ctx& ctx, jsmntok_t* tok, Value* value) {
+    const char* str = ctx.buf + tok->start;
+    const int len = tok->end - tok->start;
+    switch (tok->type) {
+    case JSMN_STRING:
+        if (value->getType() != Value::STRING) {
+            return false;
+        }
+
+        if (ctx.flags & PARSE_BORROW_STRINGS) {
+            size_t borrowed_len;
+            const char* borrowed = borrow_string(ctx, tok, borrowed_len);
+            ((String*)value)->set(BORROW, borrowed, borrowed_len);
+        } else {
+            ((String*)value)->set(UNESCAPE, str, len);
+        }
+        return true;
+    case JSMN_PRIMITIVE:
+        if (len == 0) {
+            return false;
+        }
+
+        switch (*str) {
+        case 't':
+        case 'f':
+            if (value->getType() != Value::BOOL) {
+                return false;
+            }
+            ((Bool*)value)->set(*str == 't');
+            return true;
+        case 'n':
+            return value->getType() == Value::NIL;
+        default:
+            return value->getType() == Value::NUMBER && parseNumber(str, len, *(Number*)value);
+        }
+    default:
+        return false;
+    }
+}
+
+// Same nesting limit as fill_tree, checked before parseInto touches the target
+static bool check_depth(const jsmntok_t* tokens, int count) {
+    int remaining[RBJSON_MAX_DEPTH];
+    int depth = 0;
+    for (int i = 0; i < count; ++i) {
+        while (depth > 0 && remaining[depth - 1] == 0) {
+            --depth;
+        }
+        if (depth > 0) {
+            --remaining[depth - 1];
+        }
+
+        if (tokens[i].type == JSMN_OBJECT || tokens[i].type == JSMN_ARRAY) {
+            if (depth == RBJSON_MAX_DEPTH) {
+                ESP_LOGE(TAG, "failed to parse msg: nested deeper than %d", RBJSON_MAX_DEPTH);
+                return false;
+            }
+            // Keys are tokens of their own, followed by their value
+            remaining[depth++] = tokens[i].type == JSMN_OBJECT ? tokens[i].size * 2 : tokens[i].size;
+        }
+    }
+    return true;
+}
+
+// Objects with more members than this are always rebuilt, the matched keys are tracked in a bitmask
+#define UPDATE_MAX_MEMBERS 64
+
+// Marks the member holding value as matched, returns false if it already was, i.e. the key is duplicate
+static bool mark_member(const Object* obj, const Value* value, uint64_t& seen) {
+    const auto& members = obj->members();
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (members[i].value == value) {
+            const uint64_t bit = uint64_t(1) << i;
+            if (seen & bit) {
+                return false;
+            }
+            seen |= bit;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Walks the tokens along the existing tree and overwrites its leaves.
+// Returns false as soon as the layout differs, the tree is then partially updated.
+static bool update_tree(const parse_ctx& ctx, jsmntok_t* tokens, int count, Object* root) {
+    struct Frame {
+        Value* container;
+        int remaining;
+        int item;
+        uint64_t seen; //!< Object members already matched by a key
+    };
+
+    Frame stack[RBJSON_MAX_DEPTH];
+    int depth = 0;
+
+    const size_t root_size = root->members().size();
+    if (size_t(tokens[0].size) != root_size || root_size > UPDATE_MAX_MEMBERS) {
+        return false;
+    }
+    stack[depth++] = Frame { root, tokens[0].size, 0, 0 };
+
+    int idx = 1;
+    while (depth > 0) {
+        Frame& top = stack[depth - 1];
+        if (top.remaining == 0) {
+            --depth;
+            continue;
+        }
+        --top.remaining;
+
+        if (idx >= count) {
+            return false;
+        }
+
+        Value* value;
+        if (top.container->getType() == Value::OBJECT) {
+            jsmntok_t* key = &tokens[idx];
+            if (key->type != JSMN_STRING || key->size != 1 || ++idx >= count) {
+                return false;
+            }
+
+            if (ctx.flags & PARSE_BORROW_STRINGS) {
+                size_t key_len;
+                const char* key_str = borrow_string(ctx, key, key_len);
+                value = ((Object*)top.container)->get(Key(key_str, key_len));
+            } else {
+                const decoded_key decoded(ctx.buf + key->start, key->end - key->start);
+                value = ((Object*)top.container)->get(Key(decoded.str, decoded.len));
+            }
+
+            // Same number of keys as members, but a repeated one leaves some member out
+            if (value == NULL || !mark_member((Object*)top.container, value, top.seen)) {
+                return false;
+            }
+        } else {
+            value = ((Array*)top.container)->get(top.item++);
+        }
+
+        jsmntok_t* tok = &tokens[idx];
+        if (value == NULL) {
+            return false;
+        }
+
+        if (tok->type == JSMN_OBJECT || tok->type == JSMN_ARRAY) {
+            size_t size;
+            if (tok->type == JSMN_OBJECT && value->getType() == Value::OBJECT) {
+                size = ((Object*)value)->members().size();
+                if (size > UPDATE_MAX_MEMBERS) {
+                    return false;
+                }
+            } else if (tok->type == JSMN_ARRAY && value->getType() == Value::ARRAY) {
+                size = ((Array*)value)->size();
+            } else {
+                return false;
+            }
+
+            if (size != size_t(tok->size) || depth == RBJSON_MAX_DEPTH) {
+                return false;
+            }
+            stack[depth++] = Frame { value, tok->size, 0, 0 };
+            ++idx;
+        } else {
+            if (!update_leaf(ctx, tok, value)) {
+                return false;
+            }
+            idx = skip_value(tokens, idx, count);
+        }
+    }
+    return true;
+}
+
+bool parseInto(Object& target, char* buf, size_t size, uint8_t flags) {
+    if (target.isArena()) {
+        ESP_LOGE(TAG, "parseInto needs a heap-allocated object");
+        return false;
+    }
+
+    jsmntok_t tokens_static[32];
+    std::unique_ptr<jsmntok_t[]> tokens_dynamic;
+    jsmntok_t* tokens = tokens_static;
+
+    const int parsed = tokenize(buf, size, NULL, tokens, 32, tokens_dynamic);
+    if (parsed <= 0 || tokens[0].type != JSMN_OBJECT || !check_depth(tokens, parsed)) {
+        return false;
+    }
+
+    // Decoded up front, so that the rebuild does not decode the strings the update already went through
+    uint8_t ctx_flags = PARSE_DEFAULT;
+    if (flags & PARSE_BORROW_STRINGS) {
+        decode_strings(buf, tokens, parsed);
+        ctx_flags = PARSE_BORROW_STRINGS | PARSE_STRINGS_DECODED;
+    }
+
+    const parse_ctx ctx = { buf, NULL, NULL, ctx_flags };
+    if (update_tree(ctx, tokens, parsed, &target)) {
+        return true;
+    }
+
+    // The layout has changed, target only gets the new members once they are all built
+    Object rebuilt;
+    if (!fill_tree(ctx, tokens, parsed, &rebuilt)) {
+        return false;
+    }
+    return target.swapData(rebuilt);
+}
+
+static Object* parse(const parse_ctx& ctx, size_t size) {
+    jsmntok_t tokens_static[32];
+    std::unique_ptr<jsmntok_t[]> tokens_dynamic;
+    jsmntok_t* tokens = tokens_static;
+
+    const int parsed = tokenize(ctx.buf, size, ctx.pool, tokens, 32, tokens_dynamic);
+    if (parsed < 0) {
+        return NULL;
+    }
+    return build_tree(ctx, tokens, parsed);
+}
+
+Object* parse(char* buf, size_t size) {
+    const parse_ctx ctx = { buf, NULL, NULL, PARSE_DEFAULT };
+    return parse(ctx, size);
+}
+
+Object* parse(char* buf, size_t size, Arena& arena, uint8_t flags) {
+    const parse_ctx ctx = { buf, &arena, NULL, flags };
+    return parse(ctx, size);
+}
+
+Object* parse(char* buf, size_t size, Arena& arena, TokenPool& pool, uint8_t flags) {
+    const parse_ctx ctx = { buf, &arena, &pool, flags };
+    return parse(ctx, size);
+}
+
+static bool visit_leaf(const char* buf, const jsmntok_t& tok, Handler& handler) {
+    const char* str = buf + tok.start;
+    const int len = tok.end - tok.start;
+    if (tok.type == JSMN_STRING) {
+        return handler.string(str, len);
+    }
+
+    if (tok.type != JSMN_PRIMITIVE || len == 0) {
+        return true;
+    }
+
+    switch (*str) {
+    case 't':
+        return handler.boolean(true);
+    case 'f':
+        return handler.boolean(false);
+    case 'n':
+        return handler.null();
+    default: {
+        Number num;
+        if (!parseNumber(str, len, num)) {
+            return true;
+        }
+        return handler.number(num);
+    }
+    }
+}
+
+Reader::Reader(TokenPool& pool)
+    : m_pool(pool)
+    , m_buf(NULL)
+    , m_tokens(NULL)
+    , m_count(0) {
+}
+
+bool Reader::parse(char* buf, size_t size) {
+    m_buf = buf;
+    m_count = 0;
+
+    std::unique_ptr<jsmntok_t[]> unused;
+    m_tokens = m_pool.reserve(std::min<size_t>(32, m_pool.maxTokens()));
+    if (m_tokens == NULL) {
+        return false;
+    }
+
+    const int parsed = tokenize(buf, size, &m_pool, m_tokens, m_pool.capacity(), unused);
+    if (parsed <= 0 || m_tokens[0].type != JSMN_OBJECT) {
+        return false;
+    }
+
+    // Decode all strings now, so that the lookups and visits can hand them out directly
+    decode_strings(buf, m_tokens, parsed);
+
+    m_count = parsed;
+    return true;
+}
+
+int Reader::find(const char* key, int obj) const {
+    if (obj < 0 || obj >= m_count || m_tokens[obj].type != JSMN_OBJECT) {
+        return -1;
+    }
+
+    const size_t key_len = strlen(key);
+    int idx = obj + 1;
+    for (int i = 0; i < m_tokens[obj].size && idx < m_count; ++i) {
+        const jsmntok_t& tok = m_tokens[idx];
+        if (tok.type == JSMN_STRING && tok.size == 1 && size_t(tok.end - tok.start) == key_len
+            && memcmp(m_buf + tok.start, key, key_len) == 0 && idx + 1 < m_count) {
+            return idx + 1;
+        }
+        idx = skip_value(m_tokens, idx, m_count);
+    }
+    return -1;
+}
+
+int Reader::next(int idx) const {
+    return skip_value(m_tokens, idx, m_count);
+}
+
+int Reader::childCount(int idx) const {
+    if (idx < 0 || idx >= m_count) {
+        return 0;
+    }
+    const jsmntok_t& tok = m_tokens[idx];
+    return tok.type == JSMN_OBJECT || tok.type == JSMN_ARRAY ? tok.size : 0;
+}
+
+Value::type_t Reader::typeAt(int idx) const {
+    if (idx < 0 || idx >= m_count) {
+        return Value::NIL;
+    }
+
+    const jsmntok_t& tok = m_tokens[idx];
+    switch (tok.type) {
+    case JSMN_OBJECT:
+        return Value::OBJECT;
+    case JSMN_ARRAY:
+        return Value::ARRAY;
+    case JSMN_STRING:
+        return Value::STRING;
+    case JSMN_PRIMITIVE:
+        switch (m_buf[tok.start]) {
+        case 't':
+        case 'f':
+            return Value::BOOL;
+        case 'n':
+            return Value::NIL;
+        default:
+            return Value::NUMBER;
+        }
+    default:
+        return Value::NIL;
+    }
+}
+
+const char* Reader::keyAt(int idx, size_t& len) const {
+    if (idx < 0 || idx + 1 >= m_count || m_tokens[idx].size != 1) {
+        return NULL;
+    }
+    return stringAt(idx, len);
+}
+
+const char* Reader::stringAt(int idx, size_t& len) const {
+    if (idx < 0 || idx >= m_count || m_tokens[idx].type != JSMN_STRING) {
+        return NULL;
+    }
+    const jsmntok_t& tok = m_tokens[idx];
+    len = tok.end - tok.start;
+    return m_buf + tok.start;
+}
+
+bool Reader::numberAt(int idx, Number& out) const {
+    if (idx < 0 || idx >= m_count || m_tokens[idx].type != JSMN_PRIMITIVE) {
+        return false;
+    }
+    const jsmntok_t& tok = m_tokens[idx];
+    return parseNumber(m_buf + tok.start, tok.end - tok.start, out);
+}
+
+bool Reader::boolAt(int idx, bool& out) const {
+    if (idx < 0 || idx >= m_count || m_tokens[idx].type != JSMN_PRIMITIVE) {
+        return false;
+    }
+
+    const char c = m_buf[m_tokens[idx].start];
+    if (c == 't') {
+        out = true;
+    } else if (c == 'f') {
+        out = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool Reader::contains(const char* key) const {
+    return find(key) >= 0;
+}
+
+const char* Reader::getString(const char* key, const char* def) const {
+    size_t len;
+    const char* str = stringAt(find(key), len);
+    return str ? str : def;
+}
+
+int64_t Reader::getInt(const char* key, int64_t def) const {
+    Number num;
+    return numberAt(find(key), num) ? num.getInt() : def;
+}
+
+double Reader::getDouble(const char* key, double def) const {
+    Number num;
+    return numberAt(find(key), num) ? num.get() : def;
+}
+
+bool Reader::getBool(const char* key, bool def) const {
+    bool res;
+    return boolAt(find(key), res) ? res : def;
+}
+
+bool Reader::visit(Handler& handler) const {
+    return m_count > 0 && visitValue(0, handler);
+}
+
+bool Reader::visit(const char* key, Handler& handler) const {
+    const int idx = find(key);
+    return idx >= 0 && visitValue(idx, handler);
+}
+
+// Same walk as build_tree, but the values go to the handler
+bool Reader::visitValue(int idx, Handler& handler) const {
+    struct Frame {
+        bool object;
+        int remaining;
+    };
+
+    Frame stack[RBJSON_MAX_DEPTH];
+    int depth = 0;
+
+    do {
+        if (depth > 0) {
+            Frame& top = stack[depth - 1];
+            if (top.remaining == 0) {
+                --depth;
+                if (!(top.object ? handler.endObject() : handler.endArray())) {
+                    return false;
+                }
+                continue;
+            }
+            --top.remaining;
+
+            if (top.object) {
+                const jsmntok_t& key = m_tokens[idx];
+                if (key.type != JSMN_STRING || key.size != 1) {
+                    idx = skip_value(m_tokens, idx, m_count);
+                    continue;
+                }
+
+                if (!handler.key(m_buf + key.start, key.end - key.start)) {
+                    return false;
+                }
+                ++idx;
+            }
+        }
+
+        if (idx >= m_count) {
+            return false;
+        }
+
+        const jsmntok_t& tok = m_tokens[idx];
+        if (tok.type == JSMN_OBJECT || tok.type == JSMN_ARRAY) {
+            if (depth == RBJSON_MAX_DEPTH) {
+                ESP_LOGE(TAG, "failed to visit msg: nested deeper than %d", RBJSON_MAX_DEPTH);
+                return false;
+            }
+
+            const bool object = tok.type == JSMN_OBJECT;
+            if (!(object ? handler.startObject(tok.size) : handler.startArray(tok.size))) {
+                return false;
+            }
+            stack[depth++] = Frame { object, tok.size };
+            ++idx;
+        } else {
+            if (!visit_leaf(m_buf, tok, handler)) {
+                return false;
+            }
+            idx = skip_value(m_tokens, idx, m_count);
+        }
+    } while (depth > 0);
+    return true;
+}
+
+bool parse(char* buf, size_t size, Handler& handler, TokenPool& pool) {
+    Reader reader(pool);
+    return reader.parse(buf, size) && reader.visit(handler);
+}
+
+bool Node::setLeaf(char* buf, const jsmntok_t& tok, Arena& arena, uint8_t flags) {
+    char* str = buf + tok.start;
+    const int len = tok.end - tok.start;
+    if (tok.type == JSMN_STRING) {
+        m_type = Value::STRING;
+        if (flags & PARSE_BORROW_STRINGS) {
+            m_size = unescape_in_place(str, len);
+            str[m_size] = 0;
+            m_str = str;
+        } else {
+            size_t decoded_len;
+            m_str = arena_unescape(arena, str, len, decoded_len);
+            m_size = decoded_len;
+        }
+        return true;
+    }
+
+    if (tok.type != JSMN_PRIMITIVE || len == 0) {
+        return false;
+    }
+
+    switch (*str) {
+    case 't':
+    case 'f':
+        m_type = Value::BOOL;
+        m_bool = *str == 't';
+        return true;
+    case 'n':
+        m_type = Value::NIL;
+        return true;
+    default: {
+        Number num;
+        if (!parseNumber(str, len, num)) {
+            return false;
+        }
+        m_type = Value::NUMBER;
+        m_is_int = num.isInt();
+        if (m_is_int) {
+            m_int = num.getInt();
+        } else {
+            m_double = num.get();
+        }
+        return true;
+    }
+    }
+}
+
+// Same single pass as build_tree. Children of each container are allocated at once,
+// objects take two nodes per member: the key and the value.
+Node* Node::build(char* buf, const jsmntok_t* tokens, int count, Arena& arena, uint8_t flags) {
+    if (count == 0 || tokens[0].type != JSMN_OBJECT) {
+        return NULL;
+    }
+
+    struct Frame {
+        Node* container;
+        int remaining;
+    };
+
+    Frame stack[RBJSON_MAX_DEPTH];
+    int depth = 0;
+
+    Node* root = (Node*)arena.alloc(sizeof(Node), alignof(Node));
+    root->m_type = Value::OBJECT;
+    root->m_size = 0;
+    root->m_children = (Node*)arena.alloc(2 * tokens[0].size * sizeof(Node), alignof(Node));
+    stack[depth++] = Frame { root, tokens[0].size };
+
+    int idx = 1;
+    while (depth > 0) {
+        Frame& top = stack[depth - 1];
+        if (top.remaining == 0 || idx >= count) {
+            --depth;
+            continue;
+        }
+        --top.remaining;
+
+        const bool in_object = top.container->m_type == Value::OBJECT;
+        const jsmntok_t* key = NULL;
+        if (in_object) {
+            key = &tokens[idx];
+            if (key->type != JSMN_STRING || key->size != 1) {
+                idx = skip_value(tokens, idx, count);
+                continue;
+            }
+            ++idx;
+            if (idx >= count) {
+                break;
+            }
+        }
+
+        const jsmntok_t& tok = tokens[idx];
+        Node* const slot = in_object ? &top.container->m_children[top.container->m_size * 2]
+                                     : &top.container->m_children[top.container->m_size];
+        Node* const val = in_object ? slot + 1 : slot;
+        val->m_is_int = false;
+
+        const bool is_container = tok.type == JSMN_OBJECT || tok.type == JSMN_ARRAY;
+        if (is_container) {
+            if (depth == RBJSON_MAX_DEPTH) {
+                ESP_LOGE(TAG, "failed to parse msg: nested deeper than %d", RBJSON_MAX_DEPTH);
+                return NULL;
+            }
+
+            const size_t children = tok.type == JSMN_OBJECT ? 2 * tok.size : tok.size;
+            val->m_type = tok.type == JSMN_OBJECT ? Value::OBJECT : Value::ARRAY;
+            val->m_size = 0;
+            val->m_children = children ? (Node*)arena.alloc(children * sizeof(Node), alignof(Node)) : NULL;
+            ++idx;
+        } else {
+            const bool valid = val->setLeaf(buf, tok, arena, flags);
+            idx = skip_value(tokens, idx, count);
+            if (!valid) {
+                continue;
+            }
+        }
+
+        if (key) {
+            slot->m_is_int = false;
+            slot->setLeaf(buf, *key, arena, flags);
+        }
+        ++top.container->m_size;
+
+        if (is_container) {
+            stack[depth++] = Frame { val, tok.size };
+        }
+    }
+    return root;
+}
+
+const Node* parseNodes(char* buf, size_t size, Arena& arena, TokenPool& pool, uint8_t flags) {
+    jsmntok_t tokens_static[32];
+    std::unique_ptr<jsmntok_t[]> tokens_dynamic;
+    jsmntok_t* tokens = tokens_static;
+
+    const int parsed = tokenize(buf, size, &pool, tokens, 32, tokens_dynamic);
+    if (parsed < 0) {
+        return NULL;
+    }
+    return Node::build(buf, tokens, parsed, arena, flags);
+}
+
+const Node* Node::at(size_t idx) const {
+    if (idx >= m_size) {
+        return NULL;
+    }
+
+    switch (m_type) {
+    case Value::OBJECT:
+        return &m_children[idx * 2 + 1];
+    case Value::ARRAY:
+        return &m_children[idx];
+    default:
+        return NULL;
+    }
+}
+
+StringView Node::keyAt(size_t idx) const {
+    if (m_type != Value::OBJECT || idx >= m_size) {
+        return StringView();
+    }
+    const Node& key = m_children[idx * 2];
+    return StringView(key.m_str, key.m_size);
+}
+
+int64_t Node::asInt(int64_t def) const {
+    if (m_type != Value::NUMBER) {
+        return def;
+    }
+    return m_is_int ? m_int : int64_t(m_double);
+}
+
+double Node::asDouble(double def) const {
+    if (m_type != Value::NUMBER) {
+        return def;
+    }
+    return m_is_int ? double(m_int) : m_double;
+}
+
+bool Node::asBool(bool def) const {
+    return m_type == Value::BOOL ? m_bool : def;
+}
+
+StringView Node::asStringView(StringView def) const {
+    return m_type == Value::STRING ? StringView(m_str, m_size) : def;
+}
+
+std::string Node::asString(std::string def) const {
+    return m_type == Value::STRING ? std::string(m_str, m_size) : def;
+}
+
+bool Node::contains(Key key) const {
+    return get(key) != NULL;
+}
+
+const Node* Node::get(Key key) const {
+    if (m_type != Value::OBJECT) {
+        return NULL;
+    }
+
+    // Backwards, so that the last of duplicate keys wins like in Object::set
+    const StringView str = key.str();
+    for (size_t i = m_size; i-- > 0;) {
+        const Node& name = m_children[i * 2];
+        if (name.m_size == str.size() && memcmp(name.m_str, str.data(), str.size()) == 0) {
+            return &m_children[i * 2 + 1];
+        }
+    }
+    return NULL;
+}
+
+const Node* Node::getObject(Key key) const {
+    const Node* node = get(key);
+    return node && node->m_type == Value::OBJECT ? node : NULL;
+}
+
+const Node* Node::getArray(Key key) const {
+    const Node* node = get(key);
+    return node && node->m_type == Value::ARRAY ? node : NULL;
+}
+
+std::string Node::getString(Key key, std::string def) const {
+    const Node* node = get(key);
+    return node ? node->asString(def) : def;
+}
+
+StringView Node::getStringView(Key key, StringView def) const {
+    const Node* node = get(key);
+    return node ? node->asStringView(def) : def;
+}
+
+int64_t Node::getInt(Key key, int64_t def) const {
+    const Node* node = get(key);
+    return node ? node->asInt(def) : def;
+}
+
+double Node::getDouble(Key key, double def) const {
+    const Node* node = get(key);
+    return node ? node->asDouble(def) : def;
+}
+
+bool Node::getBool(Key key, bool def) const {
+    const Node* node = get(key);
+    return node ? node->asBool(def) : def;
+}
+
+void Node::serialize(Writer& w) const {
+    char buf[RBJSON_NUMBER_MAX_LEN];
+    switch (m_type) {
+    case Value::OBJECT:
+        w.put('{');
+        for (size_t i = 0; i < m_size; ++i) {
+            if (i != 0) {
+                w.put(',');
+            }
+            m_children[i * 2].serialize(w);
+            w.put(':');
+            m_children[i * 2 + 1].serialize(w);
+        }
+        w.put('}');
+        break;
+    case Value::ARRAY:
+        w.put('[');
+        for (size_t i = 0; i < m_size; ++i) {
+            if (i != 0) {
+                w.put(',');
+            }
+            m_children[i].serialize(w);
+        }
+        w.put(']');
+        break;
+    case Value::STRING:
+        w.writeString(m_str, m_size);
+        break;
+    case Value::NUMBER:
+        if (m_is_int) {
+            w.write(buf, formatInt(buf, m_int));
+        } else {
+            w.write(buf, formatDouble(buf, m_double));
+        }
+        break;
+    case Value::BOOL:
+        if (m_bool) {
+            w.write("true", 4);
+        } else {
+            w.write("false", 5);
+        }
+        break;
+    case Value::NIL:
+        w.write("null", 4);
+        break;
+    }
+}
+
+std::string Node::str() const {
+    Writer w;
+    serialize(w);
+    return std::string(w.data(), w.size());
+}
+
+// Document tape entries. The top byte is the type, the rest depends on it:
+//   '{' '['  bits 32-55 member/item count, bits 0-31 index of the entry after the closing one
+//   '}' ']'  bits 0-31 index of the opening entry
+//   '"'      bits 32-55 length, bits 0-31 offset in the buffer
+//   'l' 'd'  followed by one entry with the bits of the int64 or double
+//   't' 'f' 'n'
+static inline uint64_t tape_entry(char type, uint32_t high, uint32_t low) {
+    return (uint64_t(uint8_t(type)) << 56) | (uint64_t(high & 0xFFFFFF) << 32) | low;
+}
+
+static inline char tape_type(uint64_t entry) {
+    return char(entry >> 56);
+}
+
+static inline uint32_t tape_high(uint64_t entry) {
+    return uint32_t(entry >> 32) & 0xFFFFFF;
+}
+
+static inline uint32_t tape_low(uint64_t entry) {
+    return uint32_t(entry);
+}
+
+Document::Document(TokenPool& pool, Arena& arena)
+    : m_pool(pool)
+    , m_arena(arena)
+    , m_buf(NULL)
+    , m_tape(NULL)
+    , m_size(0) {
+}
+
+bool Document::parse(char* buf, size_t size) {
+    m_buf = buf;
+    m_size = 0;
+
+    jsmntok_t tokens_static[32];
+    std::unique_ptr<jsmntok_t[]> tokens_dynamic;
+    jsmntok_t* tokens = tokens_static;
+
+    const int count = tokenize(buf, size, &m_pool, tokens, 32, tokens_dynamic);
+    if (count <= 0 || tokens[0].type != JSMN_OBJECT) {
+        return false;
+    }
+
+    struct Frame {
+        uint32_t start;
+        int remaining;
+        uint32_t count;
+    };
+
+    Frame stack[RBJSON_MAX_DEPTH];
+    int depth = 0;
+
+    // Every token takes at most two entries: open and close, or a number and its bits
+    uint64_t* tape = (uint64_t*)m_arena.alloc(2 * count * sizeof(uint64_t), alignof(uint64_t));
+    uint32_t pos = 0;
+
+    tape[pos] = tape_entry('{', 0, 0);
+    stack[depth++] = Frame { pos++, tokens[0].size, 0 };
+
+    int idx = 1;
+    while (depth > 0) {
+        Frame& top = stack[depth - 1];
+        const bool in_object = tape_type(tape[top.start]) == '{';
+        if (top.remaining == 0 || idx >= count) {
+            tape[pos] = tape_entry(in_object ? '}' : ']', 0, top.start);
+            tape[top.start] = tape_entry(in_object ? '{' : '[', top.count, pos + 1);
+            ++pos;
+            --depth;
+            continue;
+        }
+        --top.remaining;
+
+        const jsmntok_t* key = NULL;
+        if (in_object) {
+            key = &tokens[idx];
+            if (key->type != JSMN_STRING || key->size != 1) {
+                idx = skip_value(tokens, idx, count);
+                continue;
+            }
+            if (++idx >= count) {
+                continue;
+            }
+        }
+
+        const jsmntok_t& tok = tokens[idx];
+        uint64_t value;
+        uint64_t bits = 0;
+        bool has_bits = false;
+        const bool is_container = tok.type == JSMN_OBJECT || tok.type == JSMN_ARRAY;
+        if (is_container) {
+            if (depth == RBJSON_MAX_DEPTH) {
+                ESP_LOGE(TAG, "failed to parse msg: nested deeper than %d", RBJSON_MAX_DEPTH);
+                return false;
+            }
+            // Patched when the container is closed
+            value = tape_entry(tok.type == JSMN_OBJECT ? '{' : '[', 0, 0);
+            ++idx;
+        } else {
+            char* str = buf + tok.start;
+            const int len = tok.end - tok.start;
+            idx = skip_value(tokens, idx, count);
+
+            if (tok.type == JSMN_STRING) {
+                const size_t str_len = unescape_in_place(str, len);
+                str[str_len] = 0;
+                value = tape_entry('"', str_len, tok.start);
+            } else if (tok.type != JSMN_PRIMITIVE || len == 0) {
+                continue;
+            } else if (*str == 't' || *str == 'f' || *str == 'n') {
+                value = tape_entry(*str, 0, 0);
+            } else {
+                Number num;
+                if (!parseNumber(str, len, num)) {
+                    continue;
+                }
+
+                has_bits = true;
+                if (num.isInt()) {
+                    value = tape_entry('l', 0, 0);
+                    bits = uint64_t(num.getInt());
+                } else {
+                    value = tape_entry('d', 0, 0);
+                    const double d = num.get();
+                    memcpy(&bits, &d, sizeof(bits));
+                }
+            }
+        }
+
+        if (key) {
+            char* key_str = buf + key->start;
+            const size_t key_len = unescape_in_place(key_str, key->end - key->start);
+            key_str[key_len] = 0;
+            tape[pos++] = tape_entry('"', key_len, key->start);
+        }
+        ++top.count;
+
+        tape[pos++] = value;
+        if (has_bits) {
+            tape[pos++] = bits;
+        }
+
+        if (is_container) {
+            stack[depth++] = Frame { pos - 1, tok.size, 0 };
+        }
+    }
+
+    m_tape = tape;
+    m_size = pos;
+    return true;
+}
 
-#define TAG "RbJson"
+uint32_t Document::next(uint32_t idx) const {
+    const uint64_t entry = m_tape[idx];
+    switch (tape_type(entry)) {
+    case '{':
+    case '[':
+        return tape_low(entry);
+    case 'l':
+    case 'd':
+        return idx + 2;
+    default:
+        return idx + 1;
+    }
+}
 
-namespace rbjson {
+uint64_t Element::entry() const {
+    return m_doc ? m_doc->m_tape[m_idx] : tape_entry('n', 0, 0);
+}
+
+Value::type_t Element::getType() const {
+    switch (tape_type(entry())) {
+    case '{':
+        return Value::OBJECT;
+    case '[':
+        return Value::ARRAY;
+    case '"':
+        return Value::STRING;
+    case 'l':
+    case 'd':
+        return Value::NUMBER;
+    case 't':
+    case 'f':
+        return Value::BOOL;
+    default:
+        return Value::NIL;
+    }
+}
 
-static int count_tok_size(jsmntok_t* tok) {
-    jsmntok_t* itr = tok + 1;
-    for (int i = 0; i < tok->size; ++i) {
-        itr += count_tok_size(itr);
+bool Element::isInt() const {
+    return tape_type(entry()) == 'l';
+}
+
+size_t Element::size() const {
+    const uint64_t e = entry();
+    switch (tape_type(e)) {
+    case '{':
+    case '[':
+    case '"':
+        return tape_high(e);
+    default:
+        return 0;
     }
-    return itr - tok;
 }
 
-static inline void write_string_escaped(const char* str, std::ostream& ss) {
-    const char* start = str;
-    const char* end = NULL;
-    ss.put('"');
-    while (true) {
-        end = strpbrk(start, "\"\\\b\f\n\r\t");
-        if (end == NULL) {
-            ss.write(start, strlen(start));
-            ss.put('"');
-            return;
-        } else {
-            ss.write(start, end - start);
-            ss.put('\\');
-            switch (*end) {
-            case '"':
-            case '\\':
-                ss.put(*end);
-                break;
-            case '\b':
-                ss.put('b');
-                break;
-            case '\f':
-                ss.put('f');
-                break;
-            case '\n':
-                ss.put('n');
-                break;
-            case '\r':
-                ss.put('r');
-                break;
-            case '\t':
-                ss.put('t');
-                break;
-            default:
-                ss.put('?');
-                break;
-            }
-            start = end + 1;
+Element Element::at(size_t idx) const {
+    const uint64_t e = entry();
+    const char type = tape_type(e);
+    if ((type != '{' && type != '[') || idx >= tape_high(e)) {
+        return Element();
+    }
+
+    uint32_t itr = m_idx + 1;
+    for (size_t i = 0; i < idx; ++i) {
+        if (type == '{') {
+            ++itr; // the key
         }
+        itr = m_doc->next(itr);
     }
+    return Element(m_doc, type == '{' ? itr + 1 : itr);
 }
 
-static void fct_ostream(char c, void* arg) {
-    ((std::ostream*)arg)->put(c);
+StringView Element::keyAt(size_t idx) const {
+    const uint64_t e = entry();
+    if (tape_type(e) != '{' || idx >= tape_high(e)) {
+        return StringView();
+    }
+
+    uint32_t itr = m_idx + 1;
+    for (size_t i = 0; i < idx; ++i) {
+        itr = m_doc->next(itr + 1);
+    }
+    const uint64_t key = m_doc->m_tape[itr];
+    return StringView(m_doc->m_buf + tape_low(key), tape_high(key));
 }
 
-static Value* parse_value(char* buf, jsmntok_t* tok);
+int64_t Element::asInt(int64_t def) const {
+    switch (tape_type(entry())) {
+    case 'l':
+        return int64_t(m_doc->m_tape[m_idx + 1]);
+    case 'd':
+        return int64_t(asDouble(def));
+    default:
+        return def;
+    }
+}
 
-static Object* parse_object(char* buf, jsmntok_t* obj) {
-    if (obj->type != JSMN_OBJECT) {
-        return NULL;
+double Element::asDouble(double def) const {
+    switch (tape_type(entry())) {
+    case 'l':
+        return double(int64_t(m_doc->m_tape[m_idx + 1]));
+    case 'd': {
+        double res;
+        memcpy(&res, &m_doc->m_tape[m_idx + 1], sizeof(res));
+        return res;
+    }
+    default:
+        return def;
     }
+}
 
-    Object* res = new Object();
-    jsmntok_t* tok = obj + 1;
-    for (int i = 0; i < obj->size; ++i) {
-        if (tok->type != JSMN_STRING || tok->size != 1) {
-            continue;
-        }
+bool Element::asBool(bool def) const {
+    switch (tape_type(entry())) {
+    case 't':
+        return true;
+    case 'f':
+        return false;
+    default:
+        return def;
+    }
+}
 
-        Value* val = parse_value(buf, tok + 1);
-        if (val != NULL) {
-            std::string key(buf + tok->start, tok->end - tok->start);
-            res->set(std::move(key), val);
-        }
+StringView Element::asStringView(StringView def) const {
+    const uint64_t e = entry();
+    if (tape_type(e) != '"') {
+        return def;
+    }
+    return StringView(m_doc->m_buf + tape_low(e), tape_high(e));
+}
 
-        tok += count_tok_size(tok);
+std::string Element::asString(std::string def) const {
+    const uint64_t e = entry();
+    if (tape_type(e) != '"') {
+        return def;
     }
-    return res;
+    return std::string(m_doc->m_buf + tape_low(e), tape_high(e));
 }
 
-static Array* parse_array(char* buf, jsmntok_t* arr) {
-    if (arr->type != JSMN_ARRAY) {
-        return NULL;
+bool Element::contains(Key key) const {
+    return get(key).exists();
+}
+
+Element Element::get(Key key) const {
+    const uint64_t e = entry();
+    if (tape_type(e) != '{') {
+        return Element();
     }
 
-    Array* res = new Array();
-    jsmntok_t* tok = arr + 1;
-    for (int i = 0; i < arr->size; ++i) {
-        Value* val = parse_value(buf, tok);
-        if (val != NULL) {
-            res->push_back(val);
+    // Keys are in the message order, the last of duplicate keys wins like in Object::set
+    const StringView str = key.str();
+    const uint32_t end = tape_low(e) - 1;
+    uint32_t found = 0;
+    for (uint32_t itr = m_idx + 1; itr < end; itr = m_doc->next(itr + 1)) {
+        const uint64_t name = m_doc->m_tape[itr];
+        if (tape_high(name) == str.size() && memcmp(m_doc->m_buf + tape_low(name), str.data(), str.size()) == 0) {
+            found = itr + 1;
         }
-        tok += count_tok_size(tok);
     }
-    return res;
+    return found ? Element(m_doc, found) : Element();
 }
 
-Value* parse_value(char* buf, jsmntok_t* tok) {
-    switch (tok->type) {
-    case JSMN_OBJECT:
-        return parse_object(buf, tok);
-    case JSMN_ARRAY:
-        return parse_array(buf, tok);
-    case JSMN_STRING:
-        return new String(std::string(buf + tok->start, tok->end - tok->start));
-    case JSMN_PRIMITIVE: {
-        const char* str = buf + tok->start;
-        const int len = tok->end - tok->start;
-        if (len == 0) {
-            return NULL;
-        }
+Element Element::getObject(Key key) const {
+    const Element el = get(key);
+    return el.getType() == Value::OBJECT ? el : Element();
+}
 
-        switch (*str) {
-        case 't':
-            return new Bool(true);
-        case 'f':
-            return new Bool(false);
-        case 'n':
-            return new Nil();
-        default: {
-            char buf[32];
-            snprintf(buf, sizeof(buf), "%.*s", len, str);
+Element Element::getArray(Key key) const {
+    const Element el = get(key);
+    return el.getType() == Value::ARRAY ? el : Element();
+}
 
-            char* endptr;
-            double val = strtod(buf, &endptr);
-            if (buf == endptr) {
-                return NULL;
+std::string Element::getString(Key key, std::string def) const {
+    return get(key).asString(def);
+}
+
+StringView Element::getStringView(Key key, StringView def) const {
+    return get(key).asStringView(def);
+}
+
+int64_t Element::getInt(Key key, int64_t def) const {
+    return get(key).asInt(def);
+}
+
+double Element::getDouble(Key key, double def) const {
+    return get(key).asDouble(def);
+}
+
+bool Element::getBool(Key key, bool def) const {
+    return get(key).asBool(def);
+}
+
+void Element::serialize(Writer& w) const {
+    char buf[RBJSON_NUMBER_MAX_LEN];
+    const uint64_t e = entry();
+    switch (tape_type(e)) {
+    case '{':
+    case '[': {
+        const bool is_object = tape_type(e) == '{';
+        const uint32_t end = tape_low(e) - 1;
+        w.put(is_object ? '{' : '[');
+        for (uint32_t itr = m_idx + 1; itr < end;) {
+            if (itr != m_idx + 1) {
+                w.put(',');
             }
-            return new Number(val);
-        }
+            if (is_object) {
+                Element(m_doc, itr++).serialize(w);
+                w.put(':');
+            }
+            Element(m_doc, itr).serialize(w);
+            itr = m_doc->next(itr);
         }
+        w.put(is_object ? '}' : ']');
+        break;
     }
+    case '"':
+        w.writeString(m_doc->m_buf + tape_low(e), tape_high(e));
+        break;
+    case 'l':
+        w.write(buf, formatInt(buf, asInt()));
+        break;
+    case 'd':
+        w.write(buf, formatDouble(buf, asDouble()));
+        break;
+    case 't':
+        w.write("true", 4);
+        break;
+    case 'f':
+        w.write("false", 5);
+        break;
     default:
+        w.write("null", 4);
+        break;
+    }
+}
+
+std::string Element::str() const {
+    Writer w;
+    serialize(w);
+    return std::string(w.data(), w.size());
+}
+
+TokenPool::TokenPool(size_t max_tokens)
+    : m_tokens(NULL)
+    , m_capacity(0)
+    , m_max_tokens(max_tokens) {
+}
+
+TokenPool::~TokenPool() {
+    delete[] m_tokens;
+}
+
+jsmntok_t* TokenPool::reserve(size_t count) {
+    if (count <= m_capacity) {
+        return m_tokens;
+    }
+
+    if (count > m_max_tokens) {
         return NULL;
     }
+
+    // Leave some headroom, so that slowly growing messages do not reallocate every time
+    const size_t capacity = std::min(std::max(count, m_capacity * 2), m_max_tokens);
+    delete[] m_tokens;
+    m_tokens = new jsmntok_t[capacity];
+    m_capacity = capacity;
+    return m_tokens;
 }
 
-Object* parse(char* buf, size_t size) {
-    jsmn_parser parser;
-    size_t tokens_size = 32;
-    jsmntok_t tokens_static[32];
-    std::unique_ptr<jsmntok_t[]> tokens_dynamic;
-    jsmntok_t* tokens = tokens_static;
-    int parsed;
+// Exactly representable powers of ten, dividing by them is correctly rounded
+static const double POW10_EXACT[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-    while (true) {
-        jsmn_init(&parser);
-        parsed = jsmn_parse(&parser, buf, size, tokens, tokens_size);
-        if (parsed >= 0) {
-            break;
-        } else if (parsed == JSMN_ERROR_NOMEM) {
-            tokens_size *= 2;
-            if (tokens_size >= 128) {
-                ESP_LOGE(TAG, "failed to parse msg %.*s: too big", size, buf);
-                return NULL;
-            }
-            tokens_dynamic.reset(new jsmntok_t[tokens_size]);
-            tokens = tokens_dynamic.get();
+static bool parse_number_strtod(const char* str, size_t len, Number& out) {
+    char buf[64];
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    memcpy(buf, str, len);
+    buf[len] = 0;
+
+    char* endptr;
+    const double val = strtod(buf, &endptr);
+    if (buf == endptr) {
+        return false;
+    }
+    out.set(val);
+    return true;
+}
+
+bool parseNumber(const char* str, size_t len, Number& out) {
+    const char* itr = str;
+    const char* const end = str + len;
+
+    const bool negative = itr != end && *itr == '-';
+    if (negative) {
+        ++itr;
+    }
+
+    if (itr == end || uint8_t(*itr - '0') > 9) {
+        return parse_number_strtod(str, len, out);
+    }
+
+    // Most numbers fit into 9 digits, 64-bit multiplication is slow on 32-bit MCUs
+    uint32_t small = 0;
+    const char* const small_end = std::min(end, itr + 9);
+    while (itr != small_end && uint8_t(*itr - '0') <= 9) {
+        small = small * 10 + (*itr++ - '0');
+    }
+
+    // 19 digits still fit into uint64, whether they fit into int64 is checked at the end
+    uint64_t mantissa = small;
+    int digits = itr - str - negative;
+    while (itr != end && uint8_t(*itr - '0') <= 9) {
+        mantissa = mantissa * 10 + (*itr++ - '0');
+        if (++digits > 19) {
+            return parse_number_strtod(str, len, out);
+        }
+    }
+
+    if (itr == end) {
+        const uint64_t limit = uint64_t(INT64_MAX) + negative;
+        if (mantissa > limit) {
+            return parse_number_strtod(str, len, out);
+        }
+        if (!negative) {
+            out.set(int64_t(mantissa));
         } else {
-            ESP_LOGE(TAG, "failed to parse msg %.*s: %d", size, buf, parsed);
-            return NULL;
+            // Written so that INT64_MIN does not overflow
+            out.set(mantissa == 0 ? int64_t(0) : -int64_t(mantissa - 1) - 1);
+        }
+        return true;
+    }
+
+    if (*itr != '.') {
+        return parse_number_strtod(str, len, out);
+    }
+    ++itr;
+
+    int decimals = 0;
+    while (itr != end && uint8_t(*itr - '0') <= 9) {
+        mantissa = mantissa * 10 + (*itr++ - '0');
+        ++decimals;
+        if (++digits > 15) {
+            return parse_number_strtod(str, len, out);
         }
     }
-    return parse_object(buf, &tokens[0]);
+
+    // Exponents and anything unexpected
+    if (itr != end || decimals == 0) {
+        return parse_number_strtod(str, len, out);
+    }
+
+    const double val = double(mantissa) / POW10_EXACT[decimals];
+    out.set(negative ? -val : val);
+    return true;
 }
 
 Value::Value(Value::type_t type)
-    : m_type(type) {
+    : m_type(type)
+    , m_flags(0) {
 }
 
 Value::~Value() {
 }
 
+void Value::attachArena(Arena* /*arena*/) {
+    m_flags |= FLAG_ARENA;
+}
+
+void Value::serialize(std::ostream& ss) const {
+    Writer w;
+    serialize(w);
+    ss.write(w.data(), w.size());
+}
+
 std::string Value::str() const {
-    std::ostringstream ss;
-    serialize(ss);
-    return ss.str();
+    Writer w;
+    serialize(w);
+    return std::string(w.data(), w.size());
+}
+
+static const struct {
+    const char* str;
+    uint8_t len;
+} INTERNED_KEYS[KEY_COUNT] = {
+    { "", 0 },
+    { "c", 1 },
+    { "data", 4 },
+    { "desc", 4 },
+    { "e", 1 },
+    { "f", 1 },
+    { "msg", 3 },
+    { "n", 1 },
+    { "name", 4 },
+    { "owner", 5 },
+    { "x", 1 },
+    { "y", 1 },
+};
+
+key_id_t internKey(const char* str, size_t len) {
+    // Runs for every parsed key, so dispatch on the length and the first character
+    // instead of searching the table. Must be kept in sync with INTERNED_KEYS.
+    key_id_t id;
+    switch (len) {
+    case 1:
+        switch (str[0]) {
+        case 'c':
+            return KEY_C;
+        case 'e':
+            return KEY_E;
+        case 'f':
+            return KEY_F;
+        case 'n':
+            return KEY_N;
+        case 'x':
+            return KEY_X;
+        case 'y':
+            return KEY_Y;
+        default:
+            return KEY_NONE;
+        }
+    case 3:
+        id = KEY_MSG;
+        break;
+    case 4:
+        if (str[0] == 'd') {
+            id = str[1] == 'a' ? KEY_DATA : KEY_DESC;
+        } else {
+            id = KEY_NAME;
+        }
+        break;
+    case 5:
+        id = KEY_OWNER;
+        break;
+    default:
+        return KEY_NONE;
+    }
+    return memcmp(str, INTERNED_KEYS[id].str, len) == 0 ? id : KEY_NONE;
+}
+
+StringView keyName(key_id_t id) {
+    if (id >= KEY_COUNT) {
+        id = KEY_NONE;
+    }
+    return StringView(INTERNED_KEYS[id].str, INTERNED_KEYS[id].len);
+}
+
+Key::Key(key_id_t id)
+    : m_str(keyName(id))
+    , m_id(id) {
 }
 
 Object::Object()
-    : Value(Value::OBJECT) {
+    : Value(Value::OBJECT)
+    , m_lazy(NULL) {
 }
 
 Object::~Object() {
     for (auto itr = m_members.begin(); itr != m_members.end(); ++itr) {
-        delete itr->value;
-        free(itr->name);
+        dispose(*itr);
+    }
+}
+
+void Object::attachArena(Arena* arena) {
+    Value::attachArena(arena);
+    m_members.setArena(arena);
+}
+
+void Object::adopt(Value* value) {
+    // Heap values put into an arena object have to be deleted when the arena resets
+    Arena* arena = this->arena();
+    if (arena && !value->isArena()) {
+        arena->own(value);
+    }
+}
+
+void Object::dispose(MemberItem& member) {
+    // Arena keys and values are released by Arena::reset()
+    if (!isArena()) {
+        delete member.value;
+        if (member.key_id == KEY_NONE) {
+            free(member.name);
+        }
     }
 }
 
-void Object::serialize(std::ostream& ss) const {
-    ss.put('{');
+void Object::serialize(Writer& w) const {
+    ensureLoaded();
+    w.put('{');
     for (auto itr = m_members.cbegin(); itr != m_members.cend();) {
-        write_string_escaped(itr->name, ss);
-        ss.put(':');
-        itr->value->serialize(ss);
+        w.writeString(itr->name, itr->name_len);
+        w.put(':');
+        itr->value->serialize(w);
         if (++itr != m_members.cend()) {
-            ss.put(',');
+            w.put(',');
         }
     }
-    ss.put('}');
+    w.put('}');
 }
 
-void Object::swapData(Object& other) {
+bool Object::swapData(Object& other) {
+    if (isArena() != other.isArena() || arena() != other.arena()) {
+        ESP_LOGE(TAG, "swapData needs both objects heap-allocated or from the same arena");
+        return false;
+    }
+    ensureLoaded();
+    other.ensureLoaded();
     m_members.swap(other.m_members);
+    return true;
 }
 
-bool Object::keyLess(const MemberItem& member, const std::string& key) {
-    return strncmp(member.name, key.c_str(), std::min(size_t(254), key.length())) < 0;
+Object::KeyRef Object::makeKey(const char* str, size_t len) {
+    return KeyRef {
+        .str = str,
+        .len = (uint8_t)std::min(size_t(254), len),
+        .id = KEY_NONE,
+    };
 }
 
-bool Object::keyEqualStr(const MemberItem& a, const std::string& key) {
-    const uint8_t key_len = std::min(size_t(254), key.length());
-    if(a.name_len != key_len) {
+Object::KeyRef Object::makeKey(const Key& key) {
+    KeyRef ref = makeKey(key.str().data(), key.str().size());
+    ref.id = key.id();
+    return ref;
+}
+
+bool Object::keyLess(const MemberItem& member, const KeyRef& key) {
+    if (member.key_id != KEY_NONE && key.id != KEY_NONE) {
+        return member.key_id < key.id;
+    }
+    return strncmp(member.name, key.str, key.len) < 0;
+}
+
+bool Object::keyEqualStr(const MemberItem& a, const KeyRef& key) {
+    if (a.key_id != KEY_NONE && key.id != KEY_NONE) {
+        return a.key_id == key.id;
+    }
+    if(a.name_len != key.len) {
         return false;
     }
-    return memcmp(a.name, key.c_str(), a.name_len) == 0; 
+    return memcmp(a.name, key.str, a.name_len) == 0; 
 }
 
 bool Object::keyEqual(const MemberItem& a, const MemberItem& b) {
+    if (a.key_id != KEY_NONE || b.key_id != KEY_NONE) {
+        return a.key_id == b.key_id;
+    }
     if(a.name_len != b.name_len) {
         return false;
     }
@@ -246,6 +2025,8 @@ bool Object::equals(const Value& other) const {
         return false;
 
     const auto& obj = static_cast<const Object&>(other);
+    ensureLoaded();
+    obj.ensureLoaded();
 
     const size_t size = m_members.size();
     if (size != obj.m_members.size())
@@ -264,40 +2045,46 @@ bool Object::equals(const Value& other) const {
 }
 
 Value* Object::copy() const {
+    ensureLoaded();
     auto* res = new Object();
     res->m_members.reserve(m_members.size());
     for (const auto& pair : m_members) {
         res->m_members.emplace_back(MemberItem{
             .value = pair.value->copy(),
-            .name = strdup(pair.name),
+            .name = pair.key_id != KEY_NONE ? pair.name : strdup(pair.name),
             .name_len = pair.name_len,
+            .key_id = pair.key_id,
         });
     }
     res->m_members.shrink_to_fit();
     return res;
 }
 
-Object::container_t::const_iterator Object::lower_bound_const(const std::string& key) const {
+Object::container_t::const_iterator Object::lower_bound_const(const KeyRef& key) const {
+    ensureLoaded();
     return std::lower_bound(m_members.cbegin(), m_members.cend(), key, keyLess);
 }
 
-Object::container_t::iterator Object::lower_bound(const std::string& key) {
+Object::container_t::iterator Object::lower_bound(const KeyRef& key) {
+    ensureLoaded();
     return std::lower_bound(m_members.begin(), m_members.end(), key, keyLess);
 }
 
-bool Object::contains(const std::string& key) const {
-    const auto lower = lower_bound_const(key);
-    return lower != m_members.end() && keyEqualStr(*lower, key);
+bool Object::contains(Key key) const {
+    const auto ref = makeKey(key);
+    const auto lower = lower_bound_const(ref);
+    return lower != m_members.end() && keyEqualStr(*lower, ref);
 }
 
-Value* Object::get(const std::string& key) const {
-    const auto lower = lower_bound_const(key);
-    if (lower == m_members.end() || !keyEqualStr(*lower, key))
+Value* Object::get(Key key) const {
+    const auto ref = makeKey(key);
+    const auto lower = lower_bound_const(ref);
+    if (lower == m_members.end() || !keyEqualStr(*lower, ref))
         return NULL;
     return lower->value;
 }
 
-Object* Object::getObject(const std::string& key) const {
+Object* Object::getObject(Key key) const {
     auto* val = get(key);
     if (val && val->getType() == OBJECT) {
         return (Object*)val;
@@ -305,7 +2092,7 @@ Object* Object::getObject(const std::string& key) const {
     return NULL;
 }
 
-Array* Object::getArray(const std::string& key) const {
+Array* Object::getArray(Key key) const {
     auto* val = get(key);
     if (val && val->getType() == ARRAY) {
         return (Array*)val;
@@ -313,7 +2100,7 @@ Array* Object::getArray(const std::string& key) const {
     return NULL;
 }
 
-std::string Object::getString(const std::string& key, std::string def) const {
+std::string Object::getString(Key key, std::string def) const {
     auto* val = get(key);
     if (val && val->getType() == STRING) {
         return ((String*)val)->get();
@@ -322,16 +2109,25 @@ std::string Object::getString(const std::string& key, std::string def) const {
     }
 }
 
-int64_t Object::getInt(const std::string& key, int64_t def) const {
+StringView Object::getStringView(Key key, StringView def) const {
+    auto* val = get(key);
+    if (val && val->getType() == STRING) {
+        return ((String*)val)->view();
+    } else {
+        return def;
+    }
+}
+
+int64_t Object::getInt(Key key, int64_t def) const {
     auto* val = get(key);
     if (val && val->getType() == NUMBER) {
-        return ((Number*)val)->get();
+        return ((Number*)val)->getInt();
     } else {
         return def;
     }
 }
 
-double Object::getDouble(const std::string& key, double def) const {
+double Object::getDouble(Key key, double def) const {
     auto* val = get(key);
     if (val && val->getType() == NUMBER) {
         return ((Number*)val)->get();
@@ -340,7 +2136,7 @@ double Object::getDouble(const std::string& key, double def) const {
     }
 }
 
-bool Object::getBool(const std::string& key, bool def) const {
+bool Object::getBool(Key key, bool def) const {
     auto* val = get(key);
     if (val && val->getType() == BOOL) {
         return ((Bool*)val)->get();
@@ -349,61 +2145,171 @@ bool Object::getBool(const std::string& key, bool def) const {
     }
 }
 
-void Object::set(const std::string& key, Value* value) {
-    auto lower = lower_bound(key);
-    if (lower != m_members.end() && keyEqualStr(*lower, key)) {
-        delete lower->value;
+void Object::set(Key key, Value* value) {
+    set(makeKey(key), value);
+}
+
+void Object::set(const char* key, size_t key_len, Value* value) {
+    set(makeKey(key, key_len), value);
+}
+
+void Object::set(KeyRef ref, Value* value) {
+    adopt(value);
+
+    if (ref.id == KEY_NONE) {
+        ref.id = internKey(ref.str, ref.len);
+    }
+
+    auto lower = lower_bound(ref);
+    if (lower != m_members.end() && keyEqualStr(*lower, ref)) {
+        if (!isArena()) {
+            delete lower->value;
+        }
         lower->value = value;
     } else {
-        uint8_t name_len = std::min(size_t(254), key.length());
-        auto *name = (char*)malloc(name_len + 1);
-        memcpy(name, key.c_str(), name_len);
-        name[name_len] = 0;
+        char* name;
+        if (ref.id != KEY_NONE) {
+            name = (char*)keyName(ref.id).data();
+        } else if (Arena* arena = this->arena()) {
+            name = arena->strdup(ref.str, ref.len);
+        } else {
+            name = (char*)malloc(ref.len + 1);
+            memcpy(name, ref.str, ref.len);
+            name[ref.len] = 0;
+        }
 
         m_members.emplace(lower, MemberItem{
             .value = value,
             .name = name,
-            .name_len = name_len,
+            .name_len = ref.len,
+            .key_id = ref.id,
+        });
+    }
+}
+
+void Object::set(borrow_t, const char* key, size_t key_len, Value* value) {
+    if (!isArena() || key_len > 254) {
+        set(key, key_len, value);
+        return;
+    }
+
+    adopt(value);
+
+    auto ref = makeKey(key, key_len);
+    ref.id = internKey(ref.str, ref.len);
+    auto lower = lower_bound(ref);
+    if (lower != m_members.end() && keyEqualStr(*lower, ref)) {
+        lower->value = value;
+    } else {
+        m_members.emplace(lower, MemberItem{
+            .value = value,
+            .name = ref.id != KEY_NONE ? (char*)keyName(ref.id).data() : (char*)key,
+            .name_len = ref.len,
+            .key_id = ref.id,
         });
     }
 }
 
-void Object::set(const std::string& key, const std::string& string) {
-    set(key, new String(string));
+void Object::set(Key key, const std::string& str) {
+    set(key, StringView(str));
+}
+
+void Object::set(Key key, const char* str) {
+    set(key, StringView(str));
+}
+
+void Object::set(Key key, StringView str) {
+    Arena* arena = this->arena();
+    if (arena) {
+        set(key, arena->make<String>(BORROW, arena->strdup(str.data(), str.size()), str.size()));
+    } else {
+        set(key, new String(str.data(), str.size()));
+    }
 }
 
-void Object::set(const std::string& key, double number) {
-    set(key, new Number(number));
+void Object::set(Key key, double number) {
+    set(key, make_value<Number>(arena(), number));
 }
 
-void Object::remove(const std::string& key) {
-    const auto lower = lower_bound_const(key);
-    if (lower != m_members.end() && keyEqualStr(*lower, key)) {
-        delete lower->value;
-        free(lower->name);
+void Object::remove(Key key) {
+    const auto ref = makeKey(key);
+    const auto lower = lower_bound(ref);
+    if (lower != m_members.end() && keyEqualStr(*lower, ref)) {
+        dispose(*lower);
         m_members.erase(lower);
     }
 }
 
+void Object::clear() {
+    // A lazy object has nothing to dispose yet
+    m_lazy = NULL;
+    for (auto itr = m_members.begin(); itr != m_members.end(); ++itr) {
+        dispose(*itr);
+    }
+    m_members.clear();
+}
+
 Array::Array()
-    : Value(Value::ARRAY) {
+    : Value(Value::ARRAY)
+    , m_numbers(NULL)
+    , m_numbers_count(0)
+    , m_lazy(NULL) {
 }
 
 Array::~Array() {
     for (auto val : m_items) {
-        delete val;
+        dispose(val);
+    }
+    if (!isArena()) {
+        delete[] m_numbers;
+    }
+}
+
+void Array::attachArena(Arena* arena) {
+    Value::attachArena(arena);
+    m_items.setArena(arena);
+}
+
+Number* Array::allocNumbers(size_t count) {
+    ensureLoaded();
+    if (m_numbers != NULL) {
+        return NULL;
+    }
+
+    Arena* arena = this->arena();
+    m_numbers = arena ? arena->makeArray<Number>(count) : new Number[count];
+    m_numbers_count = count;
+    return m_numbers;
+}
+
+bool Array::ownsNumber(const Value* value) const {
+    return value >= m_numbers && value < m_numbers + m_numbers_count;
+}
+
+void Array::adopt(Value* value) {
+    Arena* arena = this->arena();
+    if (arena && !value->isArena()) {
+        arena->own(value);
+    }
+}
+
+void Array::dispose(Value* value) {
+    // Numbers from allocNumbers() are deleted all at once in ~Array()
+    if (!isArena() && !ownsNumber(value)) {
+        delete value;
     }
 }
 
-void Array::serialize(std::ostream& ss) const {
-    ss.put('[');
+void Array::serialize(Writer& w) const {
+    ensureLoaded();
+    w.put('[');
     for (size_t i = 0; i < m_items.size(); ++i) {
-        m_items[i]->serialize(ss);
+        m_items[i]->serialize(w);
         if (i + 1 != m_items.size()) {
-            ss.put(',');
+            w.put(',');
         }
     }
-    ss.put(']');
+    w.put(']');
 }
 
 bool Array::equals(const Value& other) const {
@@ -411,6 +2317,8 @@ bool Array::equals(const Value& other) const {
         return false;
 
     const auto& array = static_cast<const Array&>(other);
+    ensureLoaded();
+    array.ensureLoaded();
     if (m_items.size() != array.m_items.size())
         return false;
 
@@ -422,6 +2330,7 @@ bool Array::equals(const Value& other) const {
 }
 
 Value* Array::copy() const {
+    ensureLoaded();
     auto* res = new Array();
     res->m_items.reserve(m_items.size());
     for (const auto& it : m_items) {
@@ -431,6 +2340,7 @@ Value* Array::copy() const {
 }
 
 Value* Array::get(size_t idx) const {
+    ensureLoaded();
     if (idx < m_items.size())
         return m_items[idx];
     return NULL;
@@ -461,10 +2371,19 @@ std::string Array::getString(size_t idx, std::string def) const {
     }
 }
 
+StringView Array::getStringView(size_t idx, StringView def) const {
+    auto* val = get(idx);
+    if (val && val->getType() == STRING) {
+        return ((String*)val)->view();
+    } else {
+        return def;
+    }
+}
+
 int64_t Array::getInt(size_t idx, int64_t def) const {
     auto* val = get(idx);
     if (val && val->getType() == NUMBER) {
-        return ((Number*)val)->get();
+        return ((Number*)val)->getInt();
     } else {
         return def;
     }
@@ -489,38 +2408,106 @@ bool Array::getBool(size_t idx, bool def) const {
 }
 
 void Array::set(size_t idx, Value* value) {
+    ensureLoaded();
     if (idx < m_items.size()) {
-        delete m_items[idx];
+        adopt(value);
+        dispose(m_items[idx]);
         m_items[idx] = value;
     }
 }
 
 void Array::insert(size_t idx, Value* value) {
+    ensureLoaded();
+    adopt(value);
     m_items.insert(m_items.begin() + idx, value);
 }
 
 void Array::remove(size_t idx) {
+    ensureLoaded();
     if (idx < m_items.size()) {
-        delete m_items[idx];
+        dispose(m_items[idx]);
         m_items.erase(m_items.begin() + idx);
     }
 }
 
 String::String(const char* value)
-    : Value(STRING)
-    , m_value(value) {
+    : String(value, strlen(value)) {
 }
 
 String::String(const std::string& value)
+    : String(value.c_str(), value.size()) {
+}
+
+String::String(const char* value, size_t len)
     : Value(STRING)
-    , m_value(value) {
+    , m_len(len) {
+    char* copy = (char*)malloc(len + 1);
+    memcpy(copy, value, len);
+    copy[len] = 0;
+    m_value = copy;
+}
+
+String::String(unescape_t, const char* value, size_t len)
+    : Value(STRING) {
+    char* copy = (char*)malloc(len + 1);
+    m_len = unescape(copy, value, len);
+    copy[m_len] = 0;
+    m_value = copy;
+}
+
+String::String(borrow_t, const char* value, size_t len)
+    : Value(STRING)
+    , m_value(value)
+    , m_len(len) {
+    m_flags |= FLAG_BORROWED;
+}
+
+void String::set(const char* value, size_t len) {
+    // An owned buffer of the same length is overwritten in place
+    char* copy = (m_flags & FLAG_BORROWED) ? NULL : (char*)m_value;
+    if (copy == NULL || len != m_len) {
+        copy = (char*)realloc(copy, len + 1);
+    }
+    memcpy(copy, value, len);
+    copy[len] = 0;
+
+    m_flags &= ~FLAG_BORROWED;
+    m_value = copy;
+    m_len = len;
+}
+
+void String::set(unescape_t, const char* value, size_t len) {
+    if (memchr(value, '\\', len) == NULL) {
+        set(value, len);
+        return;
+    }
+
+    char* copy = (m_flags & FLAG_BORROWED) ? NULL : (char*)m_value;
+    copy = (char*)realloc(copy, len + 1);
+    m_len = unescape(copy, value, len);
+    copy[m_len] = 0;
+
+    m_flags &= ~FLAG_BORROWED;
+    m_value = copy;
+}
+
+void String::set(borrow_t, const char* value, size_t len) {
+    if (!(m_flags & FLAG_BORROWED)) {
+        free((void*)m_value);
+    }
+    m_flags |= FLAG_BORROWED;
+    m_value = value;
+    m_len = len;
 }
 
 String::~String() {
+    if (!(m_flags & FLAG_BORROWED)) {
+        free((void*)m_value);
+    }
 }
 
-void String::serialize(std::ostream& ss) const {
-    write_string_escaped(m_value.c_str(), ss);
+void String::serialize(Writer& w) const {
+    w.writeString(m_value, m_len);
 }
 
 bool String::equals(const Value& other) const {
@@ -528,29 +2515,27 @@ bool String::equals(const Value& other) const {
         return false;
 
     const auto& str = static_cast<const String&>(other);
-    return m_value == str.m_value;
+    return m_len == str.m_len && memcmp(m_value, str.m_value, m_len) == 0;
 }
 
 Value* String::copy() const {
-    return new String(m_value);
+    return new String(m_value, m_len);
 }
 
 Number::Number(double value)
-    : Value(NUMBER)
-    , m_value(value) {
+    : Value(NUMBER) {
+    set(value);
 }
 
 Number::~Number() {
 }
 
-void Number::serialize(std::ostream& ss) const {
-    float intpart;
-    float fracpart = fabsf(modff(m_value, &intpart));
-    if (fracpart < 0.0001f) {
-        fctprintf(fct_ostream, &ss, "%lld", (long long)m_value);
+void Number::serialize(Writer& w) const {
+    char buf[RBJSON_NUMBER_MAX_LEN];
+    if (isInt()) {
+        w.write(buf, formatInt(buf, m_int));
     } else {
-        // std::stringstream needs 1.5KB of stack to format a double
-        fctprintf(fct_ostream, &ss, "%.4f", m_value);
+        w.write(buf, formatDouble(buf, m_double));
     }
 }
 
@@ -559,11 +2544,17 @@ bool Number::equals(const Value& other) const {
         return false;
 
     const auto& num = static_cast<const Number&>(other);
-    return m_value == num.m_value;
+    if (isInt() && num.isInt()) {
+        return m_int == num.m_int;
+    }
+    return get() == num.get();
 }
 
 Value* Number::copy() const {
-    return new Number(m_value);
+    if (isInt()) {
+        return new Number(m_int);
+    }
+    return new Number(m_double);
 }
 
 Bool::Bool(bool value)
@@ -574,11 +2565,11 @@ Bool::Bool(bool value)
 Bool::~Bool() {
 }
 
-void Bool::serialize(std::ostream& ss) const {
+void Bool::serialize(Writer& w) const {
     if (m_value) {
-        ss.write("true", 4);
+        w.write("true", 4);
     } else {
-        ss.write("false", 5);
+        w.write("false", 5);
     }
 }
 
@@ -594,8 +2585,8 @@ Value* Bool::copy() const {
     return new Bool(m_value);
 }
 
-void Nil::serialize(std::ostream& ss) const {
-    ss.write("null", 4);
+void Nil::serialize(Writer& w) const {
+    w.write("null", 4);
 }
 
 Value* Nil::copy() const {
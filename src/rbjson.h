@@ -1,22 +1,495 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <sstream>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 
+#ifndef RBJSON_NUMBER_DECIMALS
+#define RBJSON_NUMBER_DECIMALS 4 //!< Maximum number of decimal places of serialized non-integer numbers
+#endif
+
+#define RBJSON_NUMBER_MAX_LEN 32 //!< Buffer size sufficient for formatInt() and formatDouble()
+
+#ifndef RBJSON_MAX_DEPTH
+#define RBJSON_MAX_DEPTH 24 //!< Maximum nesting of objects and arrays accepted by parse()
+#endif
+
+#ifndef RBJSON_OBJECT_INLINE_MEMBERS
+#define RBJSON_OBJECT_INLINE_MEMBERS 4 //!< Members of an Object stored without any allocation
+#endif
+
+#ifndef RBJSON_ARRAY_INLINE_ITEMS
+#define RBJSON_ARRAY_INLINE_ITEMS 4 //!< Items of an Array stored without any allocation
+#endif
+
+#ifndef RBJSON_MAX_TOKENS
+#define RBJSON_MAX_TOKENS 512 //!< Default limit of JSON tokens in one message, each token takes 16 bytes
+#endif
+
+#ifndef RBJSON_FAST_SCAN
+#define RBJSON_FAST_SCAN 1 //!< Tokenize messages with scanTokens() instead of jsmn_parse()
+#endif
+
+struct jsmntok;
+
 /**
  * \brief JSON-related objects
  */
 namespace rbjson {
 
+class Value;
 class Object;
+struct LazySource;
+
+/**
+ * \brief Bump allocator holding whole JSON trees in one reusable block.
+ *
+ * Values created with make() and trees returned by parse(buf, size, arena)
+ * are never deleted one by one, reset() drops all of them at once without
+ * running any destructors. The memory is kept for the next use and merged
+ * into a single block, so a steady stream of similarly sized packets does
+ * not touch the heap at all.
+ */
+class Arena {
+public:
+    explicit Arena(size_t block_size = 512);
+    ~Arena();
+
+    void* alloc(size_t size, size_t align = sizeof(double));
+    char* strdup(const char* str, size_t len); //!< Copy str into the arena and terminate it with \0
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args); //!< Construct a Value subclass inside the arena
+    template <typename T>
+    T* makeArray(size_t count); //!< Construct count default-initialized values in one contiguous block
+
+    void own(Value* value); //!< Take ownership of a heap-allocated value, it is deleted on reset()
+    void reset(); //!< Release everything allocated from this arena
+
+    size_t used() const { return m_used; } //!< Bytes allocated since the last reset()
+    size_t capacity() const { return m_capacity; } //!< Total bytes held by the arena
+
+private:
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    struct Block {
+        Block* next;
+        size_t size;
+    };
+
+    struct Owned {
+        Value* value;
+        Owned* next;
+    };
+
+    void add_block(size_t min_size);
+    void free_blocks();
+
+    Block* m_blocks;
+    Owned* m_owned;
+    char* m_pos;
+    char* m_end;
+    size_t m_block_size;
+    size_t m_used;
+    size_t m_capacity;
+};
+
+/**
+ * \brief Vector of trivially copyable items that keeps the first N of them inline.
+ *
+ * Small objects and arrays, which are most of the messages, need no allocation
+ * for their items at all. Bigger ones move the items to the Arena, or to the heap
+ * if the vector has none.
+ */
+template <typename T, size_t N>
+class SmallVector {
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    explicit SmallVector(Arena* arena = nullptr)
+        : m_data(m_inline)
+        , m_size(0)
+        , m_capacity(N)
+        , m_arena(arena) {
+    }
+
+    ~SmallVector() { release(); }
+
+    iterator begin() { return m_data; }
+    iterator end() { return m_data + m_size; }
+    const_iterator begin() const { return m_data; }
+    const_iterator end() const { return m_data + m_size; }
+    const_iterator cbegin() const { return m_data; }
+    const_iterator cend() const { return m_data + m_size; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_t capacity() const { return m_capacity; }
+
+    T& operator[](size_t idx) { return m_data[idx]; }
+    const T& operator[](size_t idx) const { return m_data[idx]; }
+
+    void reserve(size_t capacity) {
+        if (capacity > m_capacity) {
+            grow(capacity);
+        }
+    }
+
+    void shrink_to_fit();
+
+    iterator insert(const_iterator pos, const T& item) {
+        const size_t idx = pos - m_data;
+        if (m_size == m_capacity) {
+            grow(m_capacity * 2);
+        }
+        memmove(m_data + idx + 1, m_data + idx, (m_size - idx) * sizeof(T));
+        m_data[idx] = item;
+        ++m_size;
+        return m_data + idx;
+    }
+
+    iterator emplace(const_iterator pos, const T& item) { return insert(pos, item); }
+    void push_back(const T& item) { insert(end(), item); }
+    void emplace_back(const T& item) { insert(end(), item); }
+
+    iterator erase(const_iterator pos) {
+        const size_t idx = pos - m_data;
+        memmove(m_data + idx, m_data + idx + 1, (m_size - idx - 1) * sizeof(T));
+        --m_size;
+        return m_data + idx;
+    }
+
+    void clear() { m_size = 0; }
+    void swap(SmallVector& other); //!< Both vectors must use the same arena, or none
+
+    Arena* arena() const { return m_arena; }
+    void setArena(Arena* arena); //!< Allowed only while the items are inline
+
+private:
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector items are moved with memcpy");
+
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+
+    bool isInline() const { return m_data == m_inline; }
+    void grow(size_t capacity);
+    void release();
+
+    T* m_data;
+    size_t m_size;
+    size_t m_capacity;
+    Arena* m_arena;
+    T m_inline[N];
+};
+
+/**
+ * \brief std::unique_ptr deleter that releases arena-allocated trees in O(1).
+ *
+ * If arena is set, the whole arena is reset instead of deleting the value.
+ */
+struct Deleter {
+    Deleter(Arena* arena = nullptr)
+        : arena(arena) {
+    }
+
+    void operator()(Value* value) const;
+
+    Arena* arena;
+};
+
+typedef std::unique_ptr<Object, Deleter> ObjectPtr;
+
+/**
+ * \brief Serialization target writing into one contiguous buffer.
+ *
+ * The default constructor makes a writer that owns a heap buffer growing geometrically.
+ * Writer(buf, capacity) writes into a caller-provided buffer and never allocates,
+ * if the output does not fit, overflowed() is set. Writer(NULL, 0) only measures
+ * the output, so it can be used as a first pass to allocate the exact size.
+ * size() is always the full length of the output.
+ */
+class Writer {
+public:
+    Writer();
+    Writer(char* buf, size_t capacity);
+    ~Writer();
+
+    void put(char c) {
+        if (m_size < m_capacity || reserve(1)) {
+            m_buf[m_size] = c;
+        }
+        ++m_size;
+    }
+
+    void write(const char* data, size_t len) {
+        if (m_size + len <= m_capacity || reserve(len)) {
+            memcpy(m_buf + m_size, data, len);
+        }
+        m_size += len;
+    }
+
+    const char* data() const { return m_buf; }
+    size_t size() const { return m_size; }
+    bool overflowed() const { return m_overflowed; }
+
+    void writeString(const char* str, size_t len); //!< Write str as a quoted JSON string, escaping quotes, backslashes and control characters
+
+    char* release(); //!< Take over the heap buffer, free it with free(). Returns NULL for external buffers.
+    void clear();
+
+private:
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    bool reserve(size_t len);
+
+    char* m_buf;
+    size_t m_size;
+    size_t m_capacity;
+    bool m_owned;
+    bool m_overflowed;
+};
+
+/**
+ * \brief Write value as a decimal integer to out, returns the number of characters written.
+ *
+ * out must have room for RBJSON_NUMBER_MAX_LEN characters, no \0 is written.
+ */
+size_t formatInt(char* out, int64_t value);
+
+/**
+ * \brief Write value in fixed-point notation to out, returns the number of characters written.
+ *
+ * The value is rounded to at most decimals (max. 9) decimal places and trailing zeros are
+ * dropped, integral values are written without a decimal point. Values too big for int64
+ * fall back to exponent notation, NaN and infinity are written as null.
+ * out must have room for RBJSON_NUMBER_MAX_LEN characters, no \0 is written.
+ */
+size_t formatDouble(char* out, double value, uint8_t decimals = RBJSON_NUMBER_DECIMALS);
+
+class Number;
+
+/**
+ * \brief Parse a number literal of len characters, it does not have to be \0 terminated.
+ *
+ * Integers are parsed without any floating point math. Decimals with up to 15
+ * significant digits take a single division by a power of ten, only literals
+ * with an exponent or more digits fall back to strtod.
+ * Returns false if str is not a number.
+ */
+bool parseNumber(const char* str, size_t len, Number& out);
+
+/**
+ * \brief Split len bytes of JSON into tokens, with the same results as non-strict jsmn_parse() on a fresh parser.
+ *
+ * Strings and primitives are searched for their end a machine word at a time
+ * instead of byte by byte, and closing brackets find their token on a stack
+ * instead of walking the tokens backwards. With tokens NULL only counts the tokens.
+ * Returns the number of tokens or a negative jsmnerr.
+ */
+int scanTokens(const char* buf, size_t len, jsmntok* tokens, unsigned int num_tokens);
+
+/**
+ * \brief Reusable token buffer for parse(), so that big messages do not allocate on every call.
+ *
+ * Up to 32 tokens are kept on the stack, bigger messages take the tokens from
+ * the pool. It grows to the biggest message seen so far and stays allocated,
+ * messages needing more than maxTokens() tokens are rejected.
+ * Keep one per task, it must not be used by two parse() calls at once.
+ */
+class TokenPool {
+public:
+    explicit TokenPool(size_t max_tokens = RBJSON_MAX_TOKENS);
+    ~TokenPool();
+
+    jsmntok* reserve(size_t count); //!< Returns room for at least count tokens, NULL if that is over the limit
+
+    size_t capacity() const { return m_capacity; }
+    size_t maxTokens() const { return m_max_tokens; }
+
+private:
+    TokenPool(const TokenPool&) = delete;
+    TokenPool& operator=(const TokenPool&) = delete;
+
+    jsmntok* m_tokens;
+    size_t m_capacity;
+    size_t m_max_tokens;
+};
+
+/**
+ * \brief Tag for constructors and setters that reference a string instead of copying it.
+ */
+enum borrow_t { BORROW };
+
+/**
+ * \brief Tag for constructors and setters that decode the JSON escape sequences of a string while copying it.
+ *
+ * \uXXXX sequences and surrogate pairs are decoded to UTF-8, lone surrogates become U+FFFD.
+ */
+enum unescape_t { UNESCAPE };
+
+enum parse_flags_t : uint8_t {
+    PARSE_DEFAULT = 0,
+    /**
+     * Strings and keys point into the parsed buffer instead of being copied.
+     * The escapes are decoded in place, so buf is modified and must outlive the tree.
+     */
+    PARSE_BORROW_STRINGS = (1 << 0),
+    /**
+     * Nested objects and arrays are only tokenized, each one is filled in on its first use.
+     * Their source text is kept referenced, so buf must outlive the tree.
+     */
+    PARSE_LAZY = (1 << 1),
+};
 
 /**
  * \brief Parse a JSON string to an object.
  */
 Object* parse(char* buf, size_t size);
 
+/**
+ * \brief Parse a JSON string to an object, allocating the whole tree from the arena.
+ *
+ * The result must not be deleted, it lives until arena.reset().
+ * \param flags combination of parse_flags_t
+ */
+Object* parse(char* buf, size_t size, Arena& arena, uint8_t flags = PARSE_DEFAULT);
+
+/**
+ * \brief Same as parse(buf, size, arena, flags), but takes the tokens of big messages from pool.
+ */
+Object* parse(char* buf, size_t size, Arena& arena, TokenPool& pool, uint8_t flags = PARSE_DEFAULT);
+
+/**
+ * \brief Parse a JSON string into an existing heap-allocated object, reusing its values.
+ *
+ * If the message has the same layout as target, that is the same keys, array lengths
+ * and value types at every level, only the numbers, strings and bools are overwritten
+ * in place and nothing is allocated. Otherwise, including when a key repeats or an object
+ * has more than 64 members, target is rebuilt.
+ * With PARSE_BORROW_STRINGS, strings point into buf, which must outlive their use.
+ * Returns false if target is arena-allocated, if buf is not a JSON object or if it is nested
+ * deeper than RBJSON_MAX_DEPTH. Target is left untouched in all of these cases.
+ * \param flags PARSE_DEFAULT or PARSE_BORROW_STRINGS
+ */
+bool parseInto(Object& target, char* buf, size_t size, uint8_t flags = PARSE_DEFAULT);
+
+/**
+ * \brief Non-owning reference to a string, a stand-in for C++17 std::string_view.
+ *
+ * Converts implicitly from string literals, const char* and std::string,
+ * so that key lookups do not create std::string temporaries.
+ */
+class StringView {
+public:
+    StringView()
+        : m_data("")
+        , m_size(0) {
+    }
+
+    StringView(const char* str)
+        : m_data(str)
+        , m_size(strlen(str)) {
+    }
+
+    StringView(const char* str, size_t size)
+        : m_data(str)
+        , m_size(size) {
+    }
+
+    StringView(const std::string& str)
+        : m_data(str.data())
+        , m_size(str.size()) {
+    }
+
+    const char* data() const { return m_data; } //!< Not necessarily \0 terminated
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    std::string str() const { return std::string(m_data, m_size); }
+
+private:
+    const char* m_data;
+    size_t m_size;
+};
+
+inline bool operator==(const StringView& a, const StringView& b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(const StringView& a, const StringView& b) {
+    return !(a == b);
+}
+
+/**
+ * \brief Well-known keys, members with these keys share one static name instead of a copy.
+ *
+ * The ids follow the lexicographic order of the names, so interned members
+ * are ordered and looked up by comparing just the ids.
+ */
+enum key_id_t : uint8_t {
+    KEY_NONE = 0, //!< Not an interned key
+    KEY_C,
+    KEY_DATA,
+    KEY_DESC,
+    KEY_E,
+    KEY_F,
+    KEY_MSG,
+    KEY_N,
+    KEY_NAME,
+    KEY_OWNER,
+    KEY_X,
+    KEY_Y,
+    KEY_COUNT,
+};
+
+key_id_t internKey(const char* str, size_t len); //!< Returns KEY_NONE if str is not a well-known key
+StringView keyName(key_id_t id);
+
+/**
+ * \brief Key of an Object member, either a string or an interned key_id_t.
+ */
+class Key {
+public:
+    Key(key_id_t id);
+
+    Key(const char* str)
+        : m_str(str)
+        , m_id(KEY_NONE) {
+    }
+
+    Key(const char* str, size_t len)
+        : m_str(str, len)
+        , m_id(KEY_NONE) {
+    }
+
+    Key(const std::string& str)
+        : m_str(str)
+        , m_id(KEY_NONE) {
+    }
+
+    Key(StringView str)
+        : m_str(str)
+        , m_id(KEY_NONE) {
+    }
+
+    StringView str() const { return m_str; }
+    key_id_t id() const { return m_id; }
+
+private:
+    StringView m_str;
+    key_id_t m_id;
+};
+
 /**
  * \brief Base JSON value class, not instanceable.
  */
@@ -34,7 +507,13 @@ public:
     Value(type_t type = NIL);
     virtual ~Value();
 
-    virtual void serialize(std::ostream& ss) const = 0; //!< Serialize the value to a string
+    static void* operator new(size_t size) { return ::operator new(size); }
+    static void* operator new(size_t, void* ptr) { return ptr; }
+    static void operator delete(void* ptr) { ::operator delete(ptr); }
+    static void operator delete(void*, void*) {}
+
+    virtual void serialize(Writer& w) const = 0; //!< Serialize the value to a buffer
+    void serialize(std::ostream& ss) const; //!< Serialize the value to a stream
     std::string str() const; //!< Helper that calls serialize() and returns a string
 
     //!< Get the object type
@@ -47,14 +526,30 @@ public:
         return m_type == NIL;
     }
 
+    //!< Return true if the value lives in an Arena
+    bool isArena() const {
+        return m_flags & FLAG_ARENA;
+    }
+
     virtual bool equals(const Value& other) const {
         return m_type == other.m_type;
     }
 
-    virtual Value* copy() const = 0;
+    virtual Value* copy() const = 0; //!< Deep copy, the copy is always heap-allocated
 
 protected:
+    friend class Arena;
+
+    enum flags_t : uint8_t {
+        FLAG_ARENA = (1 << 0),
+        FLAG_BORROWED = (1 << 1),
+        FLAG_NUMBER_INT = (1 << 2),
+    };
+
+    virtual void attachArena(Arena* arena);
+
     type_t m_type;
+    uint8_t m_flags;
 };
 
 class Array;
@@ -66,53 +561,104 @@ class Object : public Value {
 public:
     struct __attribute__ ((packed)) MemberItem {
         Value *value;
-        char *name;
+        char *name; //!< Always \0 terminated, points to the static name of interned keys
         uint8_t name_len;
+        key_id_t key_id; //!< KEY_NONE if the key is not interned
     };
 
-    typedef std::vector<MemberItem> container_t;
+    typedef SmallVector<MemberItem, RBJSON_OBJECT_INLINE_MEMBERS> container_t;
 
     static Object* parse(char* buf, size_t size);
 
     Object();
     ~Object();
 
-    void serialize(std::ostream& ss) const;
+    using Value::serialize;
+    void serialize(Writer& w) const;
     bool equals(const Value& other) const;
     Value* copy() const;
 
-    void swapData(Object& other);
+    //! Exchange members with other. Both objects must be either heap-allocated or from the same arena,
+    //! returns false and leaves both untouched otherwise.
+    bool swapData(Object& other);
 
-    bool contains(const std::string& key) const;
-    const container_t& members() const { return m_members; }
+    bool contains(Key key) const;
+    const container_t& members() const {
+        ensureLoaded();
+        return m_members;
+    }
 
-    Value* get(const std::string& key) const;
-    Object* getObject(const std::string& key) const;
-    Array* getArray(const std::string& key) const;
-    std::string getString(const std::string& key, std::string def = "") const;
-    int64_t getInt(const std::string& key, int64_t def = 0) const;
-    double getDouble(const std::string& key, double def = 0.0) const;
-    bool getBool(const std::string& key, bool def = false) const;
+    Value* get(Key key) const;
+    Object* getObject(Key key) const;
+    Array* getArray(Key key) const;
+    std::string getString(Key key, std::string def = "") const;
+    StringView getStringView(Key key, StringView def = StringView()) const; //!< Points into the String value, which is always \0 terminated
+    int64_t getInt(Key key, int64_t def = 0) const;
+    double getDouble(Key key, double def = 0.0) const;
+    bool getBool(Key key, bool def = false) const;
 
-    void set(const std::string& key, Value* value);
-    void set(const std::string& key, const std::string& str);
-    void set(const std::string& key, double number);
+    void set(Key key, Value* value);
+    void set(Key key, const std::string& str);
+    void set(Key key, const char* str);
+    void set(Key key, StringView str);
+    void set(Key key, double number);
+    void set(const char* key, size_t key_len, Value* value);
 
-    void remove(const std::string& key);
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    void set(Key key, T number);
+    void set(borrow_t, const char* key, size_t key_len, Value* value); //!< Reference the \0 terminated key without copying, if this is an arena object
+
+    void remove(Key key);
+    void clear(); //!< Remove all members
+
+    void reserve(size_t size) {
+        ensureLoaded();
+        m_members.reserve(size);
+    }
 
     void shrink_to_fit() {
+        ensureLoaded();
         m_members.shrink_to_fit();
     }
 
+    Arena* arena() const { return m_members.arena(); }
+
+protected:
+    void attachArena(Arena* arena);
+
 private:
-    static bool keyLess(const MemberItem& member, const std::string& key);
-    static bool keyEqualStr(const MemberItem& a, const std::string& key);
+    friend struct LazySource;
+
+    struct KeyRef {
+        const char* str;
+        uint8_t len;
+        key_id_t id;
+    };
+
+    static KeyRef makeKey(const char* str, size_t len);
+    static KeyRef makeKey(const Key& key);
+    static bool keyLess(const MemberItem& member, const KeyRef& key);
+    static bool keyEqualStr(const MemberItem& a, const KeyRef& key);
     static bool keyEqual(const MemberItem& a, const MemberItem& b);
 
-    container_t::const_iterator lower_bound_const(const std::string& key) const;
-    container_t::iterator lower_bound(const std::string& key);
+    void set(KeyRef key, Value* value);
+
+    container_t::const_iterator lower_bound_const(const KeyRef& key) const;
+    container_t::iterator lower_bound(const KeyRef& key);
+
+    void adopt(Value* value);
+    void dispose(MemberItem& member);
+
+    //!< Fill in the members of a PARSE_LAZY object
+    void ensureLoaded() const {
+        if (m_lazy) {
+            load();
+        }
+    }
+    void load() const;
 
     container_t m_members;
+    mutable LazySource* m_lazy;
 };
 
 /**
@@ -123,16 +669,21 @@ public:
     Array();
     ~Array();
 
-    void serialize(std::ostream& ss) const;
+    using Value::serialize;
+    void serialize(Writer& w) const;
     bool equals(const Value& other) const;
     Value* copy() const;
 
-    size_t size() const { return m_items.size(); };
+    size_t size() const {
+        ensureLoaded();
+        return m_items.size();
+    };
 
     Value* get(size_t idx) const;
     Object* getObject(size_t idx) const;
     Array* getArray(size_t idx) const;
     std::string getString(size_t idx, std::string def = "") const;
+    StringView getStringView(size_t idx, StringView def = StringView()) const; //!< Points into the String value, which is always \0 terminated
     int64_t getInt(size_t idx, int64_t def = 0) const;
     double getDouble(size_t idx, double def = 0.0) const;
     bool getBool(size_t idx, bool def = false) const;
@@ -140,16 +691,53 @@ public:
     void set(size_t idx, Value* value);
     void insert(size_t idx, Value* value);
     void push_back(Value* value) {
-        insert(m_items.size(), value);
+        insert(size(), value);
     }
     void remove(size_t idx);
 
+    void reserve(size_t size) {
+        ensureLoaded();
+        m_items.reserve(size);
+    }
+
     void shrink_to_fit() {
+        ensureLoaded();
         m_items.shrink_to_fit();
     }
 
+    Arena* arena() const { return m_items.arena(); }
+
+    /**
+     * \brief Allocate count numbers in one contiguous block owned by this array.
+     *
+     * Add them with push_back() or insert() like any other value. They are released
+     * together with the array, so they must not be moved to another container.
+     * An array can have only one such block, returns NULL if it already has it.
+     */
+    Number* allocNumbers(size_t count);
+
+protected:
+    void attachArena(Arena* arena);
+
 private:
-    std::vector<Value*> m_items;
+    friend struct LazySource;
+
+    void adopt(Value* value);
+    void dispose(Value* value);
+    bool ownsNumber(const Value* value) const;
+
+    //!< Fill in the items of a PARSE_LAZY array
+    void ensureLoaded() const {
+        if (m_lazy) {
+            load();
+        }
+    }
+    void load() const;
+
+    SmallVector<Value*, RBJSON_ARRAY_INLINE_ITEMS> m_items;
+    Number* m_numbers;
+    size_t m_numbers_count;
+    mutable LazySource* m_lazy;
 };
 
 /**
@@ -159,34 +747,76 @@ class String : public Value {
 public:
     explicit String(const char* value = "");
     explicit String(const std::string& value);
+    String(const char* value, size_t len);
+    String(unescape_t, const char* value, size_t len); //!< Copy value with its escape sequences decoded
+    String(borrow_t, const char* value, size_t len); //!< Reference value without copying, it must be \0 terminated and outlive the String
     ~String();
 
-    void serialize(std::ostream& ss) const;
+    using Value::serialize;
+    void serialize(Writer& w) const;
     bool equals(const Value& other) const;
     Value* copy() const;
 
-    const std::string& get() const { return m_value; };
+    //! Returns a copy, it used to be a const std::string& before Strings stopped owning one.
+    //! Use view() or c_str() to read the value without allocating.
+    std::string get() const { return std::string(m_value, m_len); };
+    void set(const char* value, size_t len); //!< Copy value, only for heap-allocated strings
+    void set(unescape_t, const char* value, size_t len); //!< Copy value with its escape sequences decoded, only for heap-allocated strings
+    void set(borrow_t, const char* value, size_t len); //!< Reference value without copying, it must be \0 terminated and outlive the String
+    const char* c_str() const { return m_value; } //!< Always \0 terminated
+    StringView view() const { return StringView(m_value, m_len); }
+    size_t size() const { return m_len; }
 
 private:
-    std::string m_value;
+    const char* m_value;
+    size_t m_len;
 };
 
 /**
- * \brief A JSON Number. It's a double internally.
+ * \brief A JSON Number. Integers are kept exactly as int64, anything else as a double.
  */
 class Number : public Value {
 public:
     explicit Number(double value = 0.0);
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    explicit Number(T value)
+        : Value(NUMBER) {
+        set(value);
+    }
+
     ~Number();
 
-    void serialize(std::ostream& ss) const;
+    using Value::serialize;
+    void serialize(Writer& w) const;
     bool equals(const Value& other) const;
     Value* copy() const;
 
-    double get() const { return m_value; };
+    bool isInt() const { return m_flags & FLAG_NUMBER_INT; } //!< Returns true if the number is stored as an integer
+
+    double get() const { return isInt() ? double(m_int) : m_double; };
+    int64_t getInt() const { return isInt() ? m_int : int64_t(m_double); };
+
+    void set(double value) {
+        m_double = value;
+        m_flags &= ~FLAG_NUMBER_INT;
+    }
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    void set(T value) {
+        if (std::is_unsigned<T>::value && sizeof(T) >= sizeof(int64_t) && uint64_t(value) > uint64_t(INT64_MAX)) {
+            set(double(value));
+        } else {
+            m_int = int64_t(value);
+            m_flags |= FLAG_NUMBER_INT;
+        }
+    }
 
 private:
-    float m_value;
+    union {
+        int64_t m_int;
+        double m_double;
+    };
 };
 
 /**
@@ -197,11 +827,13 @@ public:
     explicit Bool(bool value = false);
     ~Bool();
 
-    void serialize(std::ostream& ss) const;
+    using Value::serialize;
+    void serialize(Writer& w) const;
     bool equals(const Value& other) const;
     Value* copy() const;
 
     bool get() const { return m_value; };
+    void set(bool value) { m_value = value; }
 
 private:
     bool m_value;
@@ -212,8 +844,351 @@ private:
  */
 class Nil : public Value {
 public:
-    void serialize(std::ostream& ss) const;
+    using Value::serialize;
+    void serialize(Writer& w) const;
     Value* copy() const;
 };
 
+/**
+ * \brief Receives the events of Reader::visit(), return false from any of them to stop the walk.
+ *
+ * Strings point into the parsed buffer, they are \0 terminated and their escapes are decoded.
+ */
+class Handler {
+public:
+    virtual ~Handler() {}
+
+    virtual bool startObject(size_t /*members*/) { return true; }
+    virtual bool key(const char* /*str*/, size_t /*len*/) { return true; }
+    virtual bool endObject() { return true; }
+
+    virtual bool startArray(size_t /*items*/) { return true; }
+    virtual bool endArray() { return true; }
+
+    virtual bool string(const char* /*str*/, size_t /*len*/) { return true; }
+    virtual bool number(const Number& /*value*/) { return true; }
+    virtual bool boolean(bool /*value*/) { return true; }
+    virtual bool null() { return true; }
+};
+
+/**
+ * \brief Reads a JSON message without building the Object tree.
+ *
+ * parse() only tokenizes the message and decodes its strings in place, members
+ * of the root object are then looked up directly in the tokens and visit()
+ * replays the message to a Handler. Nothing is allocated once the pool has grown.
+ * The buffer is modified and must outlive the Reader, the tokens are valid until
+ * the pool is used again.
+ */
+class Reader {
+public:
+    explicit Reader(TokenPool& pool);
+
+    bool parse(char* buf, size_t size); //!< The root must be an object
+
+    bool contains(const char* key) const;
+    const char* getString(const char* key, const char* def = "") const; //!< Points into the parsed buffer
+    int64_t getInt(const char* key, int64_t def = 0) const;
+    double getDouble(const char* key, double def = 0.0) const;
+    bool getBool(const char* key, bool def = false) const;
+
+    bool visit(Handler& handler) const; //!< Walk the whole message, returns false if the handler stopped it
+    bool visit(const char* key, Handler& handler) const; //!< Walk only the value of a root member, false if it is missing
+
+    // Token-level access, used by the typed bindings in rbjson_bind.h.
+    // Values are addressed by their token index, the root object is 0.
+    int tokenCount() const { return m_count; }
+    int find(const char* key, int obj = 0) const; //!< Index of the member's value, -1 if it is missing
+    int next(int idx) const; //!< Index of the token after the value at idx, a key is skipped together with its value
+    int childCount(int idx) const; //!< Number of members of an object or items of an array, the first one is at idx + 1
+    Value::type_t typeAt(int idx) const;
+    const char* keyAt(int idx, size_t& len) const; //!< NULL if the token is not a key
+    const char* stringAt(int idx, size_t& len) const; //!< NULL if the token is not a string
+    bool numberAt(int idx, Number& out) const;
+    bool boolAt(int idx, bool& out) const;
+
+private:
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    bool visitValue(int idx, Handler& handler) const;
+
+    TokenPool& m_pool;
+    char* m_buf;
+    jsmntok* m_tokens;
+    int m_count;
+};
+
+/**
+ * \brief Tokenize buf and walk it with handler, without building the Object tree.
+ */
+bool parse(char* buf, size_t size, Handler& handler, TokenPool& pool);
+
+/**
+ * \brief Compact read-only JSON value, an alternative to the Value tree.
+ *
+ * Each node is 16 bytes with no vtable: numbers, bools and null are stored inline,
+ * strings and the children of objects and arrays point into the Arena.
+ * Children are stored contiguously, an object member takes two nodes (key and value),
+ * so walking the tree touches only a few cache lines. Created by parseNodes().
+ */
+class Node {
+public:
+    Value::type_t getType() const { return Value::type_t(m_type); }
+    bool isNil() const { return m_type == Value::NIL; }
+    bool isInt() const { return m_type == Value::NUMBER && m_is_int; } //!< Returns true if the number is stored as an integer
+
+    size_t size() const { return m_size; } //!< Number of members or items, length of a string
+
+    const Node* at(size_t idx) const; //!< Item of an array or value of an object member, NULL if out of range
+    StringView keyAt(size_t idx) const; //!< Key of an object member
+
+    int64_t asInt(int64_t def = 0) const;
+    double asDouble(double def = 0.0) const;
+    bool asBool(bool def = false) const;
+    StringView asStringView(StringView def = StringView()) const; //!< Always \0 terminated
+    std::string asString(std::string def = "") const;
+
+    bool contains(Key key) const;
+    const Node* get(Key key) const; //!< NULL if the member is missing or this is not an object
+    const Node* getObject(Key key) const;
+    const Node* getArray(Key key) const;
+    std::string getString(Key key, std::string def = "") const;
+    StringView getStringView(Key key, StringView def = StringView()) const;
+    int64_t getInt(Key key, int64_t def = 0) const;
+    double getDouble(Key key, double def = 0.0) const;
+    bool getBool(Key key, bool def = false) const;
+
+    void serialize(Writer& w) const;
+    std::string str() const;
+
+private:
+    friend const Node* parseNodes(char* buf, size_t size, Arena& arena, TokenPool& pool, uint8_t flags);
+
+    static Node* build(char* buf, const jsmntok* tokens, int count, Arena& arena, uint8_t flags);
+    bool setLeaf(char* buf, const jsmntok& tok, Arena& arena, uint8_t flags);
+
+    uint8_t m_type;
+    bool m_is_int;
+    uint32_t m_size;
+    union {
+        int64_t m_int;
+        double m_double;
+        bool m_bool;
+        const char* m_str;
+        Node* m_children;
+    };
+};
+
+/**
+ * \brief Parse a JSON string to compact nodes allocated from the arena.
+ *
+ * The root must be an object. The result lives until arena.reset().
+ * \param flags combination of parse_flags_t
+ */
+const Node* parseNodes(char* buf, size_t size, Arena& arena, TokenPool& pool, uint8_t flags = PARSE_DEFAULT);
+
+class Document;
+
+/**
+ * \brief Reference to one value of a Document, valid as long as the document.
+ *
+ * Lookups of missing members return an Element for which exists() is false
+ * and whose getters return the defaults, so they can be chained.
+ */
+class Element {
+public:
+    Element()
+        : m_doc(NULL)
+        , m_idx(0) {
+    }
+
+    bool exists() const { return m_doc != NULL; }
+    Value::type_t getType() const; //!< NIL if the element does not exist
+    bool isNil() const { return getType() == Value::NIL; }
+    bool isInt() const; //!< Returns true if the number is stored as an integer
+
+    size_t size() const; //!< Number of members or items, length of a string
+
+    Element at(size_t idx) const; //!< Item of an array or value of an object member
+    StringView keyAt(size_t idx) const; //!< Key of an object member
+
+    int64_t asInt(int64_t def = 0) const;
+    double asDouble(double def = 0.0) const;
+    bool asBool(bool def = false) const;
+    StringView asStringView(StringView def = StringView()) const; //!< Points into the parsed buffer, always \0 terminated
+    std::string asString(std::string def = "") const;
+
+    bool contains(Key key) const;
+    Element get(Key key) const;
+    Element getObject(Key key) const;
+    Element getArray(Key key) const;
+    std::string getString(Key key, std::string def = "") const;
+    StringView getStringView(Key key, StringView def = StringView()) const;
+    int64_t getInt(Key key, int64_t def = 0) const;
+    double getDouble(Key key, double def = 0.0) const;
+    bool getBool(Key key, bool def = false) const;
+
+    void serialize(Writer& w) const;
+    std::string str() const;
+
+private:
+    friend class Document;
+
+    Element(const Document* doc, uint32_t idx)
+        : m_doc(doc)
+        , m_idx(idx) {
+    }
+
+    uint64_t entry() const;
+
+    const Document* m_doc;
+    uint32_t m_idx;
+};
+
+/**
+ * \brief Read-only parsed message stored as one contiguous tape, in the style of simdjson.
+ *
+ * Every value is one 64-bit entry holding its type and either the string's offset
+ * and length in the parsed buffer, or the member count and the skip offset of
+ * an object or array, so that lookups jump over nested values without walking them.
+ * Numbers take one more entry with their bits. Keys precede their values.
+ * Strings are decoded in place, so the buffer is modified and must outlive the document.
+ * The tape is allocated from the arena and lives until arena.reset().
+ */
+class Document {
+public:
+    Document(TokenPool& pool, Arena& arena);
+
+    bool parse(char* buf, size_t size); //!< The root must be an object
+
+    Element root() const { return m_size ? Element(this, 0) : Element(); }
+    size_t tapeSize() const { return m_size; } //!< Number of 64-bit tape entries
+
+    bool contains(Key key) const { return root().contains(key); }
+    Element get(Key key) const { return root().get(key); }
+    Element getObject(Key key) const { return root().getObject(key); }
+    Element getArray(Key key) const { return root().getArray(key); }
+    std::string getString(Key key, std::string def = "") const { return root().getString(key, def); }
+    StringView getStringView(Key key, StringView def = StringView()) const { return root().getStringView(key, def); }
+    int64_t getInt(Key key, int64_t def = 0) const { return root().getInt(key, def); }
+    double getDouble(Key key, double def = 0.0) const { return root().getDouble(key, def); }
+    bool getBool(Key key, bool def = false) const { return root().getBool(key, def); }
+
+private:
+    friend class Element;
+
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    uint32_t next(uint32_t idx) const; //!< Index of the entry after the value at idx
+
+    TokenPool& m_pool;
+    Arena& m_arena;
+    char* m_buf;
+    uint64_t* m_tape;
+    uint32_t m_size;
+};
+
+template <typename T, typename... Args>
+T* Arena::make(Args&&... args) {
+    T* value = new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    static_cast<Value*>(value)->attachArena(this);
+    return value;
+}
+
+template <typename T>
+T* Arena::makeArray(size_t count) {
+    T* values = (T*)alloc(count * sizeof(T), alignof(T));
+    for (size_t i = 0; i < count; ++i) {
+        static_cast<Value*>(new (&values[i]) T())->attachArena(this);
+    }
+    return values;
+}
+
+template <typename T, size_t N>
+void SmallVector<T, N>::grow(size_t capacity) {
+    T* data;
+    if (m_arena) {
+        data = (T*)m_arena->alloc(capacity * sizeof(T), alignof(T));
+    } else if (!isInline()) {
+        data = (T*)realloc(m_data, capacity * sizeof(T));
+    } else {
+        data = (T*)malloc(capacity * sizeof(T));
+    }
+
+    if (data == NULL) {
+        abort();
+    }
+
+    if (data != m_data && (m_arena || isInline())) {
+        memcpy(data, m_data, m_size * sizeof(T));
+    }
+    m_data = data;
+    m_capacity = capacity;
+}
+
+template <typename T, size_t N>
+void SmallVector<T, N>::release() {
+    if (!isInline() && !m_arena) {
+        free(m_data);
+    }
+}
+
+template <typename T, size_t N>
+void SmallVector<T, N>::shrink_to_fit() {
+    // Arena memory is only released by Arena::reset()
+    if (isInline() || m_arena || m_size == m_capacity) {
+        return;
+    }
+
+    if (m_size <= N) {
+        memcpy(m_inline, m_data, m_size * sizeof(T));
+        free(m_data);
+        m_data = m_inline;
+        m_capacity = N;
+    } else {
+        T* data = (T*)realloc(m_data, m_size * sizeof(T));
+        if (data != NULL) {
+            m_data = data;
+            m_capacity = m_size;
+        }
+    }
+}
+
+template <typename T, size_t N>
+void SmallVector<T, N>::swap(SmallVector& other) {
+    const bool was_inline = isInline();
+    const bool other_was_inline = other.isInline();
+
+    for (size_t i = 0; i < N; ++i) {
+        std::swap(m_inline[i], other.m_inline[i]);
+    }
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_arena, other.m_arena);
+
+    if (other_was_inline) {
+        m_data = m_inline;
+    }
+    if (was_inline) {
+        other.m_data = other.m_inline;
+    }
+}
+
+template <typename T, size_t N>
+void SmallVector<T, N>::setArena(Arena* arena) {
+    if (!isInline()) {
+        abort();
+    }
+    m_arena = arena;
+}
+
+template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type>
+void Object::set(Key key, T number) {
+    Arena* arena = this->arena();
+    set(key, arena ? arena->make<Number>(number) : new Number(number));
+}
+
 };
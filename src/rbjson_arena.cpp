@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbjson.h"
+
+namespace rbjson {
+
+Arena::Arena(size_t block_size)
+    : m_blocks(NULL)
+    , m_owned(NULL)
+    , m_pos(NULL)
+    , m_end(NULL)
+    , m_block_size(block_size)
+    , m_used(0)
+    , m_capacity(0) {
+}
+
+Arena::~Arena() {
+    reset();
+    free_blocks();
+}
+
+void Arena::add_block(size_t min_size) {
+    // Grow geometrically, so that a big message needs only a few blocks
+    size_t size = std::max(m_block_size, m_capacity);
+    if (size < min_size) {
+        size = min_size;
+    }
+
+    Block* block = (Block*)malloc(sizeof(Block) + size);
+    if (block == NULL) {
+        abort();
+    }
+    block->next = m_blocks;
+    block->size = size;
+    m_blocks = block;
+    m_capacity += size;
+
+    m_pos = (char*)(block + 1);
+    m_end = m_pos + size;
+}
+
+void Arena::free_blocks() {
+    while (m_blocks) {
+        Block* next = m_blocks->next;
+        free(m_blocks);
+        m_blocks = next;
+    }
+    m_pos = m_end = NULL;
+    m_capacity = 0;
+}
+
+void* Arena::alloc(size_t size, size_t align) {
+    char* ptr = (char*)(((uintptr_t)m_pos + align - 1) & ~(uintptr_t)(align - 1));
+    if (m_pos == NULL || ptr + size > m_end) {
+        add_block(size + align);
+        ptr = (char*)(((uintptr_t)m_pos + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    m_used += (ptr + size) - m_pos;
+    m_pos = ptr + size;
+    return ptr;
+}
+
+char* Arena::strdup(const char* str, size_t len) {
+    char* res = (char*)alloc(len + 1, 1);
+    memcpy(res, str, len);
+    res[len] = 0;
+    return res;
+}
+
+void Arena::own(Value* value) {
+    Owned* owned = (Owned*)alloc(sizeof(Owned), alignof(Owned));
+    owned->value = value;
+    owned->next = m_owned;
+    m_owned = owned;
+}
+
+void Arena::reset() {
+    for (Owned* itr = m_owned; itr != NULL; itr = itr->next) {
+        delete itr->value;
+    }
+    m_owned = NULL;
+
+    // Merge the blocks into one, so that the next tree of the same size fits in
+    if (m_blocks && m_blocks->next) {
+        const size_t capacity = m_capacity;
+        free_blocks();
+        add_block(capacity);
+    } else if (m_blocks) {
+        m_pos = (char*)(m_blocks + 1);
+    }
+    m_used = 0;
+}
+
+void Deleter::operator()(Value* value) const {
+    if (arena) {
+        arena->reset();
+    } else {
+        delete value;
+    }
+}
+
+};
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <string.h>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "rbjson.h"
+
+namespace rbjson {
+
+/**
+ * \brief One JSON member of a bound struct, create it with field().
+ */
+template <typename S, typename T>
+struct Field {
+    const char* name;
+    uint8_t len;
+    T S::*member;
+};
+
+template <typename S, typename T, size_t N>
+constexpr Field<S, T> field(const char (&name)[N], T S::*member) {
+    static_assert(N - 1 <= UINT8_MAX, "JSON key is too long");
+    return Field<S, T> { name, uint8_t(N - 1), member };
+}
+
+/**
+ * \brief List of JSON members of a struct, specialized by RBJSON_BIND.
+ */
+template <typename T>
+struct Binding {
+    static const bool bound = false;
+};
+
+/**
+ * \brief Declare the JSON members of a struct, so that it can be used with decode() and encode().
+ *
+ * Must be used at global scope. Members can be integers, floating point numbers, bools,
+ * std::string, const char* (points into the parsed buffer), char arrays,
+ * other bound structs and std::vectors or arrays of any of these.
+ *
+ * \code
+ * struct Axis {
+ *     int32_t x;
+ *     int32_t y;
+ * };
+ * RBJSON_BIND(Axis, rbjson::field("x", &Axis::x), rbjson::field("y", &Axis::y))
+ * \endcode
+ */
+#define RBJSON_BIND(Struct, ...)                                          \
+    namespace rbjson {                                                    \
+    template <>                                                           \
+    struct Binding<Struct> {                                              \
+        static const bool bound = true;                                   \
+        typedef decltype(std::make_tuple(__VA_ARGS__)) fields_t;          \
+        static fields_t fields() { return std::make_tuple(__VA_ARGS__); } \
+    };                                                                    \
+    }
+
+namespace internal {
+
+template <typename T>
+struct is_number : std::integral_constant<bool, std::is_arithmetic<T>::value && !std::is_same<T, bool>::value> {
+};
+
+template <typename T>
+struct is_c_string : std::integral_constant<bool, std::is_same<T, const char*>::value || std::is_same<T, char*>::value> {
+};
+
+inline bool decodeValue(const Reader& r, int idx, bool& out);
+inline bool decodeValue(const Reader& r, int idx, std::string& out);
+inline bool decodeValue(const Reader& r, int idx, const char*& out);
+template <size_t N>
+bool decodeValue(const Reader& r, int idx, char (&out)[N]);
+template <typename T>
+typename std::enable_if<is_number<T>::value, bool>::type decodeValue(const Reader& r, int idx, T& out);
+template <typename T, typename A>
+bool decodeValue(const Reader& r, int idx, std::vector<T, A>& out);
+template <typename A>
+bool decodeValue(const Reader& r, int idx, std::vector<bool, A>& out);
+template <typename T, size_t N>
+bool decodeValue(const Reader& r, int idx, T (&out)[N]);
+template <typename S>
+typename std::enable_if<Binding<S>::bound, bool>::type decodeValue(const Reader& r, int idx, S& out);
+
+inline void encodeValue(Writer& w, bool value);
+inline void encodeValue(Writer& w, const std::string& value);
+template <typename T>
+typename std::enable_if<is_c_string<T>::value>::type encodeValue(Writer& w, const T& value);
+template <size_t N>
+void encodeValue(Writer& w, const char (&value)[N]);
+template <typename T>
+typename std::enable_if<is_number<T>::value>::type encodeValue(Writer& w, T value);
+template <typename T, typename A>
+void encodeValue(Writer& w, const std::vector<T, A>& value);
+template <typename T, size_t N>
+void encodeValue(Writer& w, const T (&value)[N]);
+template <typename S>
+typename std::enable_if<Binding<S>::bound>::type encodeValue(Writer& w, const S& value);
+
+inline bool decodeValue(const Reader& r, int idx, bool& out) {
+    return r.boolAt(idx, out);
+}
+
+inline bool decodeValue(const Reader& r, int idx, std::string& out) {
+    size_t len;
+    const char* str = r.stringAt(idx, len);
+    if (str == NULL) {
+        return false;
+    }
+    out.assign(str, len);
+    return true;
+}
+
+inline bool decodeValue(const Reader& r, int idx, const char*& out) {
+    size_t len;
+    const char* str = r.stringAt(idx, len);
+    if (str == NULL) {
+        return false;
+    }
+    out = str;
+    return true;
+}
+
+template <size_t N>
+bool decodeValue(const Reader& r, int idx, char (&out)[N]) {
+    size_t len;
+    const char* str = r.stringAt(idx, len);
+    if (str == NULL) {
+        return false;
+    }
+
+    // Truncated to fit, the result is always \0 terminated
+    if (len >= N) {
+        len = N - 1;
+    }
+    memcpy(out, str, len);
+    out[len] = 0;
+    return true;
+}
+
+template <typename T>
+typename std::enable_if<is_number<T>::value, bool>::type decodeValue(const Reader& r, int idx, T& out) {
+    Number num;
+    if (!r.numberAt(idx, num)) {
+        return false;
+    }
+    out = std::is_floating_point<T>::value ? T(num.get()) : T(num.getInt());
+    return true;
+}
+
+template <typename T, typename A>
+bool decodeValue(const Reader& r, int idx, std::vector<T, A>& out) {
+    if (r.typeAt(idx) != Value::ARRAY) {
+        return false;
+    }
+
+    const int count = r.childCount(idx);
+    out.clear();
+    out.resize(count);
+
+    bool ok = true;
+    int item = idx + 1;
+    for (int i = 0; i < count; ++i) {
+        ok &= decodeValue(r, item, out[i]);
+        item = r.next(item);
+    }
+    return ok;
+}
+
+// std::vector<bool> hands out proxies instead of bool&, so items go through a temporary
+template <typename A>
+bool decodeValue(const Reader& r, int idx, std::vector<bool, A>& out) {
+    if (r.typeAt(idx) != Value::ARRAY) {
+        return false;
+    }
+
+    const int count = r.childCount(idx);
+    out.clear();
+    out.resize(count);
+
+    bool ok = true;
+    int item = idx + 1;
+    for (int i = 0; i < count; ++i) {
+        bool value = false;
+        ok &= decodeValue(r, item, value);
+        out[i] = value;
+        item = r.next(item);
+    }
+    return ok;
+}
+
+// Only the first N items are decoded, the rest of the array is left as it was
+template <typename T, size_t N>
+bool decodeValue(const Reader& r, int idx, T (&out)[N]) {
+    if (r.typeAt(idx) != Value::ARRAY) {
+        return false;
+    }
+
+    const int count = r.childCount(idx);
+    bool ok = true;
+    int item = idx + 1;
+    for (int i = 0; i < count && size_t(i) < N; ++i) {
+        ok &= decodeValue(r, item, out[i]);
+        item = r.next(item);
+    }
+    return ok;
+}
+
+template <size_t I, typename S, typename Fields>
+typename std::enable_if<(I == std::tuple_size<Fields>::value), bool>::type
+decodeMember(const Reader&, int, const char*, size_t, S&, const Fields&) {
+    return true; // unknown keys are ignored
+}
+
+template <size_t I, typename S, typename Fields>
+typename std::enable_if<(I < std::tuple_size<Fields>::value), bool>::type
+decodeMember(const Reader& r, int idx, const char* key, size_t len, S& out, const Fields& fields) {
+    const auto& f = std::get<I>(fields);
+    if (f.len == len && memcmp(f.name, key, len) == 0) {
+        return decodeValue(r, idx, out.*(f.member));
+    }
+    return decodeMember<I + 1>(r, idx, key, len, out, fields);
+}
+
+template <typename S>
+typename std::enable_if<Binding<S>::bound, bool>::type decodeValue(const Reader& r, int idx, S& out) {
+    if (r.typeAt(idx) != Value::OBJECT) {
+        return false;
+    }
+
+    const auto fields = Binding<S>::fields();
+    const int count = r.childCount(idx);
+
+    bool ok = true;
+    int item = idx + 1;
+    for (int i = 0; i < count; ++i) {
+        size_t len;
+        const char* key = r.keyAt(item, len);
+        if (key != NULL) {
+            ok &= decodeMember<0>(r, item + 1, key, len, out, fields);
+        }
+        item = r.next(item);
+    }
+    return ok;
+}
+
+inline void encodeValue(Writer& w, bool value) {
+    if (value) {
+        w.write("true", 4);
+    } else {
+        w.write("false", 5);
+    }
+}
+
+inline void encodeValue(Writer& w, const std::string& value) {
+    w.writeString(value.data(), value.size());
+}
+
+template <typename T>
+typename std::enable_if<is_c_string<T>::value>::type encodeValue(Writer& w, const T& value) {
+    if (value == NULL) {
+        w.write("null", 4);
+    } else {
+        w.writeString(value, strlen(value));
+    }
+}
+
+template <size_t N>
+void encodeValue(Writer& w, const char (&value)[N]) {
+    const char* end = (const char*)memchr(value, 0, N);
+    w.writeString(value, end ? end - value : N);
+}
+
+template <typename T>
+typename std::enable_if<is_number<T>::value>::type encodeValue(Writer& w, T value) {
+    char buf[RBJSON_NUMBER_MAX_LEN];
+    if (std::is_floating_point<T>::value
+        || (std::is_unsigned<T>::value && sizeof(T) >= sizeof(int64_t) && uint64_t(value) > uint64_t(INT64_MAX))) {
+        w.write(buf, formatDouble(buf, double(value)));
+    } else {
+        w.write(buf, formatInt(buf, int64_t(value)));
+    }
+}
+
+template <typename T, typename A>
+void encodeValue(Writer& w, const std::vector<T, A>& value) {
+    w.put('[');
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (i != 0) {
+            w.put(',');
+        }
+        encodeValue(w, value[i]);
+    }
+    w.put(']');
+}
+
+template <typename T, size_t N>
+void encodeValue(Writer& w, const T (&value)[N]) {
+    w.put('[');
+    for (size_t i = 0; i < N; ++i) {
+        if (i != 0) {
+            w.put(',');
+        }
+        encodeValue(w, value[i]);
+    }
+    w.put(']');
+}
+
+template <size_t I, typename S, typename Fields>
+typename std::enable_if<(I == std::tuple_size<Fields>::value)>::type
+encodeMember(Writer&, const S&, const Fields&) {
+}
+
+template <size_t I, typename S, typename Fields>
+typename std::enable_if<(I < std::tuple_size<Fields>::value)>::type
+encodeMember(Writer& w, const S& value, const Fields& fields) {
+    const auto& f = std::get<I>(fields);
+    if (I != 0) {
+        w.put(',');
+    }
+    w.put('"');
+    w.write(f.name, f.len);
+    w.write("\":", 2);
+    encodeValue(w, value.*(f.member));
+    encodeMember<I + 1>(w, value, fields);
+}
+
+template <typename S>
+typename std::enable_if<Binding<S>::bound>::type encodeValue(Writer& w, const S& value) {
+    w.put('{');
+    encodeMember<0>(w, value, Binding<S>::fields());
+    w.put('}');
+}
+
+};
+
+/**
+ * \brief Decode the root object of a parsed message into a bound struct.
+ *
+ * Members missing from the message are left untouched, unknown keys are ignored.
+ * Returns false if the message is not parsed or some member has a wrong type,
+ * the other members are still decoded.
+ */
+template <typename T>
+bool decode(const Reader& reader, T& out) {
+    return reader.tokenCount() > 0 && internal::decodeValue(reader, 0, out);
+}
+
+/**
+ * \brief Decode a member of the root object, returns false if it is missing or has a wrong type.
+ */
+template <typename T>
+bool decode(const Reader& reader, const char* key, T& out) {
+    const int idx = reader.find(key);
+    return idx >= 0 && internal::decodeValue(reader, idx, out);
+}
+
+/**
+ * \brief Serialize a bound struct (or any other supported value) to JSON.
+ *
+ * Keys are written in the order of the RBJSON_BIND declaration.
+ */
+template <typename T>
+void encode(Writer& w, const T& value) {
+    internal::encodeValue(w, value);
+}
+
+};
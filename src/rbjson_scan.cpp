@@ -0,0 +1,265 @@
+#include <string.h>
+
+#define JSMN_HEADER
+#include "./jsmn.h"
+#include "rbjson.h"
+
+namespace rbjson {
+
+// The first matching byte is found with a count of trailing zeros, which only works on little endian
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+typedef size_t word_t;
+
+static const word_t ONES = ~word_t(0) / 0xFF;
+static const word_t HIGH_BITS = ONES * 0x80;
+
+// High bit set in the bytes equal to c. Bytes above the first match may be flagged too,
+// the lowest flagged byte is always exact.
+static inline word_t match_byte(word_t word, uint8_t c) {
+    const word_t x = word ^ (ONES * c);
+    return (x - ONES) & ~x & HIGH_BITS;
+}
+
+// High bit set in the bytes below c, c must be at most 0x80. Same precision as match_byte().
+static inline word_t match_below(word_t word, uint8_t c) {
+    return (word - ONES * c) & ~word & HIGH_BITS;
+}
+
+static inline size_t first_byte(word_t mask) {
+    return __builtin_ctzll((unsigned long long)mask) / 8;
+}
+
+static inline word_t load_word(const char* ptr) {
+    word_t word;
+    memcpy(&word, ptr, sizeof(word));
+    return word;
+}
+
+// Position of the first '"', '\\' or '\0' at or after pos, len if there is none
+static size_t find_string_special(const char* js, size_t pos, size_t len) {
+    while (len - pos >= sizeof(word_t)) {
+        const word_t word = load_word(js + pos);
+        const word_t mask = match_byte(word, '"') | match_byte(word, '\\') | match_below(word, 1);
+        if (mask) {
+            return pos + first_byte(mask);
+        }
+        pos += sizeof(word_t);
+    }
+
+    for (; pos < len; ++pos) {
+        const char c = js[pos];
+        if (c == '"' || c == '\\' || c == '\0') {
+            break;
+        }
+    }
+    return pos;
+}
+
+// Position of the first byte that ends a primitive or is not allowed in one, len if there is none
+static size_t find_primitive_end(const char* js, size_t pos, size_t len) {
+    while (len - pos >= sizeof(word_t)) {
+        const word_t word = load_word(js + pos);
+        const word_t mask = match_below(word, '!') | (word & HIGH_BITS) | match_byte(word, 0x7F)
+            | match_byte(word, ':') | match_byte(word, ',') | match_byte(word, ']') | match_byte(word, '}');
+        if (mask) {
+            return pos + first_byte(mask);
+        }
+        pos += sizeof(word_t);
+    }
+
+    for (; pos < len; ++pos) {
+        const uint8_t c = js[pos];
+        if (c <= ' ' || c >= 0x7F || c == ':' || c == ',' || c == ']' || c == '}') {
+            break;
+        }
+    }
+    return pos;
+}
+
+static inline bool is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
+}
+
+// Validates the string starting at the opening quote at pos like jsmn_parse_string() does.
+// Returns the position of the closing quote or a jsmn error.
+static int scan_string(const char* js, size_t pos, size_t len) {
+    ++pos;
+    while (true) {
+        pos = find_string_special(js, pos, len);
+        if (pos >= len || js[pos] == '\0') {
+            return JSMN_ERROR_PART;
+        }
+
+        if (js[pos] == '"') {
+            return pos;
+        }
+
+        // Backslash, a lone one at the very end is left for the PART error above
+        if (++pos >= len) {
+            continue;
+        }
+
+        switch (js[pos]) {
+        case '"':
+        case '/':
+        case '\\':
+        case 'b':
+        case 'f':
+        case 'r':
+        case 'n':
+        case 't':
+            ++pos;
+            break;
+        case 'u':
+            ++pos;
+            for (int i = 0; i < 4 && pos < len && js[pos] != '\0'; ++i, ++pos) {
+                if (!is_hex(js[pos])) {
+                    return JSMN_ERROR_INVAL;
+                }
+            }
+            break;
+        default:
+            return JSMN_ERROR_INVAL;
+        }
+    }
+}
+
+static jsmntok_t* alloc_token(jsmntok_t* tokens, unsigned int& toknext, unsigned int num_tokens,
+    jsmntype_t type, int start, int end) {
+    if (toknext >= num_tokens) {
+        return NULL;
+    }
+    jsmntok_t* tok = &tokens[toknext++];
+    tok->type = type;
+    tok->start = start;
+    tok->end = end;
+    tok->size = 0;
+    return tok;
+}
+
+int scanTokens(const char* js, size_t len, jsmntok_t* tokens, unsigned int num_tokens) {
+    // Indexes of the objects and arrays that are not closed yet, jsmn searches for them backwards
+    int open[RBJSON_MAX_DEPTH + 1];
+    int depth = 0;
+    int toksuper = -1;
+    unsigned int toknext = 0;
+    int count = 0;
+
+    for (size_t pos = 0; pos < len && js[pos] != '\0'; ++pos) {
+        const char c = js[pos];
+        switch (c) {
+        case '{':
+        case '[': {
+            ++count;
+            if (tokens == NULL) {
+                break;
+            }
+            if (depth == sizeof(open) / sizeof(open[0])) {
+                // Too deep for the stack above, which parse() would reject anyway
+                jsmn_parser parser;
+                jsmn_init(&parser);
+                return jsmn_parse(&parser, js, len, tokens, num_tokens);
+            }
+
+            jsmntok_t* tok = alloc_token(tokens, toknext, num_tokens, c == '{' ? JSMN_OBJECT : JSMN_ARRAY, pos, -1);
+            if (tok == NULL) {
+                return JSMN_ERROR_NOMEM;
+            }
+            if (toksuper != -1) {
+                tokens[toksuper].size++;
+            }
+            toksuper = toknext - 1;
+            open[depth++] = toksuper;
+            break;
+        }
+        case '}':
+        case ']': {
+            if (tokens == NULL) {
+                break;
+            }
+            if (depth == 0) {
+                return JSMN_ERROR_INVAL;
+            }
+            jsmntok_t& tok = tokens[open[depth - 1]];
+            if (tok.type != (c == '}' ? JSMN_OBJECT : JSMN_ARRAY)) {
+                return JSMN_ERROR_INVAL;
+            }
+            tok.end = pos + 1;
+            --depth;
+            toksuper = depth ? open[depth - 1] : -1;
+            break;
+        }
+        case '"': {
+            const int end = scan_string(js, pos, len);
+            if (end < 0) {
+                return end;
+            }
+            if (tokens != NULL) {
+                if (alloc_token(tokens, toknext, num_tokens, JSMN_STRING, pos + 1, end) == NULL) {
+                    return JSMN_ERROR_NOMEM;
+                }
+                if (toksuper != -1) {
+                    tokens[toksuper].size++;
+                }
+            }
+            ++count;
+            pos = end;
+            break;
+        }
+        case '\t':
+        case '\r':
+        case '\n':
+        case ' ':
+            break;
+        case ':':
+            toksuper = toknext - 1;
+            break;
+        case ',':
+            if (tokens != NULL && toksuper != -1 && depth != 0
+                && tokens[toksuper].type != JSMN_ARRAY && tokens[toksuper].type != JSMN_OBJECT) {
+                toksuper = open[depth - 1];
+            }
+            break;
+        default: {
+            // Every unquoted value is a primitive, as in non-strict jsmn
+            const size_t end = find_primitive_end(js, pos, len);
+            if (end < len) {
+                const char e = js[end];
+                if (e != '\0' && e != ':' && e != ',' && e != ']' && e != '}'
+                    && e != ' ' && e != '\t' && e != '\r' && e != '\n') {
+                    return JSMN_ERROR_INVAL;
+                }
+            }
+            if (tokens != NULL) {
+                if (alloc_token(tokens, toknext, num_tokens, JSMN_PRIMITIVE, pos, end) == NULL) {
+                    return JSMN_ERROR_NOMEM;
+                }
+                if (toksuper != -1) {
+                    tokens[toksuper].size++;
+                }
+            }
+            ++count;
+            pos = end - 1;
+            break;
+        }
+        }
+    }
+
+    if (tokens != NULL && depth != 0) {
+        return JSMN_ERROR_PART;
+    }
+    return count;
+}
+
+#else
+
+int scanTokens(const char* js, size_t len, jsmntok_t* tokens, unsigned int num_tokens) {
+    jsmn_parser parser;
+    jsmn_init(&parser);
+    return jsmn_parse(&parser, js, len, tokens, num_tokens);
+}
+
+#endif
+
+};
@@ -0,0 +1,273 @@
+#include <cmath>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbjson.h"
+
+namespace rbjson {
+
+static const char DIGIT_PAIRS[201] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+static const uint32_t POW10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+// Writes the digits right-aligned, ending just before end. Returns pointer to the first digit.
+static char* format_u32_backwards(char* end, uint32_t value) {
+    while (value >= 100) {
+        const uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--end = DIGIT_PAIRS[pair + 1];
+        *--end = DIGIT_PAIRS[pair];
+    }
+    if (value >= 10) {
+        *--end = DIGIT_PAIRS[value * 2 + 1];
+        *--end = DIGIT_PAIRS[value * 2];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+static size_t format_u64(char* out, uint64_t value) {
+    char tmp[20];
+    char* const end = tmp + sizeof(tmp);
+    char* start;
+
+    // 64-bit division is slow on 32-bit MCUs, stay in 32 bits whenever possible
+    if (value <= UINT32_MAX) {
+        start = format_u32_backwards(end, value);
+    } else {
+        start = end;
+        while (value > UINT32_MAX) {
+            const uint32_t low = value % 1000000000;
+            value /= 1000000000;
+            char* low_start = format_u32_backwards(start, low);
+            while (low_start > start - 9) {
+                *--low_start = '0';
+            }
+            start = low_start;
+        }
+        start = format_u32_backwards(start, value);
+    }
+
+    const size_t len = end - start;
+    memcpy(out, start, len);
+    return len;
+}
+
+size_t formatInt(char* out, int64_t value) {
+    if (value < 0) {
+        *out = '-';
+        return 1 + format_u64(out + 1, -(uint64_t)value);
+    }
+    return format_u64(out, value);
+}
+
+static size_t format_exponent(char* out, double value, uint8_t decimals) {
+    int exponent = (int)floor(log10(value));
+    double mantissa = value / pow(10.0, exponent);
+    if (mantissa >= 10.0) {
+        mantissa /= 10.0;
+        ++exponent;
+    }
+
+    size_t len = formatDouble(out, mantissa, decimals);
+    out[len++] = 'e';
+    return len + formatInt(out + len, exponent);
+}
+
+size_t formatDouble(char* out, double value, uint8_t decimals) {
+    if (!std::isfinite(value)) {
+        memcpy(out, "null", 4);
+        return 4;
+    }
+
+    size_t len = 0;
+    if (value < 0) {
+        out[len++] = '-';
+        value = -value;
+    }
+
+    if (decimals > 9) {
+        decimals = 9;
+    }
+
+    if (value >= 9.2e18) {
+        return len + format_exponent(out + len, value, decimals);
+    }
+
+    // Split in double precision, 64-bit division is expensive without hardware support
+    uint64_t intpart = (uint64_t)value;
+    if (double(intpart) == value) {
+        return len + format_u64(out + len, intpart);
+    }
+
+    const uint32_t scale = POW10[decimals];
+    uint32_t fracpart = (uint32_t)((value - intpart) * scale + 0.5);
+    if (fracpart >= scale) {
+        ++intpart;
+        fracpart -= scale;
+    }
+
+    len += format_u64(out + len, intpart);
+    if (fracpart == 0) {
+        // -0.00001 rounds to 0, do not write "-0"
+        if (intpart == 0) {
+            out[0] = '0';
+            return 1;
+        }
+        return len;
+    }
+
+    while (fracpart % 10 == 0) {
+        fracpart /= 10;
+        --decimals;
+    }
+
+    out[len++] = '.';
+    char* const frac_end = out + len + decimals;
+    char* frac_start = format_u32_backwards(frac_end, fracpart);
+    while (frac_start > out + len) {
+        *--frac_start = '0';
+    }
+    return len + decimals;
+}
+
+Writer::Writer()
+    : m_buf(NULL)
+    , m_size(0)
+    , m_capacity(0)
+    , m_owned(true)
+    , m_overflowed(false) {
+}
+
+Writer::Writer(char* buf, size_t capacity)
+    : m_buf(buf)
+    , m_size(0)
+    , m_capacity(capacity)
+    , m_owned(false)
+    , m_overflowed(false) {
+}
+
+Writer::~Writer() {
+    if (m_owned) {
+        free(m_buf);
+    }
+}
+
+bool Writer::reserve(size_t len) {
+    if (!m_owned || m_overflowed) {
+        m_overflowed = true;
+        return false;
+    }
+
+    size_t capacity = m_capacity ? m_capacity * 2 : 64;
+    if (capacity < m_size + len) {
+        capacity = m_size + len;
+    }
+
+    char* buf = (char*)realloc(m_buf, capacity);
+    if (buf == NULL) {
+        m_overflowed = true;
+        return false;
+    }
+    m_buf = buf;
+    m_capacity = capacity;
+    return true;
+}
+
+// Second character of the escape sequence, 'u' for \u00XX, 0 if the character is written as it is
+static const char ESCAPE_CHARS[0x5D] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\',
+};
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// True if any byte of the word is '"', '\\' or a control character. Bytes above
+// a matching one may be reported too, but a matching byte is never missed.
+static inline bool needs_escape(size_t word) {
+    const size_t ones = ~size_t(0) / 0xFF;
+    const size_t high_bits = ones * 0x80;
+
+    const size_t quote = word ^ (ones * '"');
+    const size_t backslash = word ^ (ones * '\\');
+    const size_t found = ((quote - ones) & ~quote)
+        | ((backslash - ones) & ~backslash)
+        | ((word - ones * 0x20) & ~word);
+    return found & high_bits;
+}
+
+void Writer::writeString(const char* str, size_t len) {
+    const char* start = str;
+    const char* const end = str + len;
+
+    put('"');
+    const char* itr = str;
+    while (itr != end) {
+        // Skip a word at a time while there is nothing to escape
+        while (size_t(end - itr) >= sizeof(size_t)) {
+            size_t word;
+            memcpy(&word, itr, sizeof(word));
+            if (needs_escape(word)) {
+                break;
+            }
+            itr += sizeof(size_t);
+        }
+
+        const char* const chunk_end = size_t(end - itr) > sizeof(size_t) ? itr + sizeof(size_t) : end;
+        for (; itr != chunk_end; ++itr) {
+            const uint8_t c = *itr;
+            const char escaped = c < sizeof(ESCAPE_CHARS) ? ESCAPE_CHARS[c] : 0;
+            if (escaped == 0) {
+                continue;
+            }
+
+            write(start, itr - start);
+            if (escaped == 'u') {
+                const char seq[6] = { '\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xF] };
+                write(seq, sizeof(seq));
+            } else {
+                const char seq[2] = { '\\', escaped };
+                write(seq, sizeof(seq));
+            }
+            start = itr + 1;
+        }
+    }
+    write(start, end - start);
+    put('"');
+}
+
+char* Writer::release() {
+    if (!m_owned) {
+        return NULL;
+    }
+
+    char* res = m_buf;
+    m_buf = NULL;
+    m_size = 0;
+    m_capacity = 0;
+    m_overflowed = false;
+    return res;
+}
+
+void Writer::clear() {
+    m_size = 0;
+    m_overflowed = false;
+}
+
+};
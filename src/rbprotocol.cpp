@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <esp_log.h>
 #include <cstring>
 
@@ -12,6 +13,8 @@
 #define MUST_ARRIVE_TIMER_PERIOD MS_TO_TICKS(100)
 #define MUST_ARRIVE_ATTEMPTS 15
 
+#define SEND_TIMEOUT pdMS_TO_TICKS(200)
+
 namespace rb {
 
 using namespace rb::internal;
@@ -21,15 +24,174 @@ const ProtocolConfig Protocol::DEFAULT_CONFIG = {
     .enable_ws = true,
     .ws_register_with_webserver = true,
     .udp_port = 42424,
+    .send_buffer_count = 32,
+    .send_buffer_size = 256,
+    .send_queue_depth = 32,
 };
 
+SendPool::SendPool(uint16_t count, uint16_t slot_size)
+    : m_buf(new char[size_t(count) * slot_size])
+    , m_free(xQueueCreate(count, sizeof(int16_t)))
+    , m_slot_size(slot_size)
+    , m_count(count)
+    , m_in_use(0)
+    , m_high_watermark(0) {
+    for (int16_t i = 0; i < count; ++i) {
+        xQueueSend(m_free, &i, 0);
+    }
+}
+
+SendPool::~SendPool() {
+    vQueueDelete(m_free);
+    delete[] m_buf;
+}
+
+int16_t SendPool::acquire(TickType_t timeout) {
+    int16_t slot;
+    if (xQueueReceive(m_free, &slot, timeout) != pdTRUE) {
+        return -1;
+    }
+
+    const uint16_t in_use = m_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint16_t high = m_high_watermark.load(std::memory_order_relaxed);
+    while (in_use > high && !m_high_watermark.compare_exchange_weak(high, in_use, std::memory_order_relaxed)) {
+    }
+    return slot;
+}
+
+void SendPool::release(int16_t slot) {
+    m_in_use.fetch_sub(1, std::memory_order_relaxed);
+    xQueueSend(m_free, &slot, 0);
+}
+
+SendQueue::SendQueue(uint16_t capacity)
+    : m_enqueue_pos(0)
+    , m_dequeue_pos(0)
+    , m_high_watermark(0) {
+    uint32_t size = 1;
+    while (size < capacity && size < 32768) {
+        size *= 2;
+    }
+
+    m_cells = new Cell[size];
+    m_mask = size - 1;
+    for (uint32_t i = 0; i < size; ++i) {
+        m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+SendQueue::~SendQueue() {
+    delete[] m_cells;
+}
+
+bool SendQueue::push(const QueueItem& item, bool& was_empty) {
+    Cell* cell;
+    uint32_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &m_cells[pos & m_mask];
+        const int32_t diff = int32_t(cell->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            // The cell is free, claim it unless another producer was faster
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer did not get to this cell in the previous round yet
+            return false;
+        } else {
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // The consumer cannot get past this cell before it is filled
+    const uint16_t depth = pos + 1 - m_dequeue_pos.load(std::memory_order_relaxed);
+    was_empty = depth == 1;
+
+    cell->item = item;
+    cell->seq.store(pos + 1, std::memory_order_release);
+
+    uint16_t high = m_high_watermark.load(std::memory_order_relaxed);
+    while (depth > high && !m_high_watermark.compare_exchange_weak(high, depth, std::memory_order_relaxed)) {
+    }
+    return true;
+}
+
+bool SendQueue::pop(QueueItem& out) {
+    Cell* cell;
+    uint32_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &m_cells[pos & m_mask];
+        const int32_t diff = int32_t(cell->seq.load(std::memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+            if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    out = cell->item;
+    // Free for the producer one round later
+    cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+uint16_t SendQueue::size() const {
+    const uint32_t dequeue_pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    const int32_t size = int32_t(m_enqueue_pos.load(std::memory_order_relaxed) - dequeue_pos);
+    return size > 0 ? std::min<uint32_t>(size, m_mask + 1) : 0;
+}
+
+AddrSnapshot::AddrSnapshot()
+    : m_seq(0) {
+    for (auto& word : m_words) {
+        word.store(0, std::memory_order_relaxed);
+    }
+}
+
+void AddrSnapshot::store(const ProtocolAddr& addr) {
+    uint32_t words[WORDS] = {};
+    memcpy(words, &addr, sizeof(addr));
+
+    const uint32_t seq = m_seq.load(std::memory_order_relaxed);
+    m_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < WORDS; ++i) {
+        m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_seq.store(seq + 2, std::memory_order_release);
+}
+
+ProtocolAddr AddrSnapshot::load() const {
+    uint32_t words[WORDS];
+    uint32_t before, after;
+    do {
+        before = m_seq.load(std::memory_order_acquire);
+        for (size_t i = 0; i < WORDS; ++i) {
+            words[i] = m_words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = m_seq.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+
+    ProtocolAddr addr;
+    memcpy(&addr, words, sizeof(addr));
+    return addr;
+}
+
 Protocol::Protocol(const char* owner, const char* name, const char* description, Protocol::callback_t callback) {
     m_owner = owner;
     m_name = name;
     m_desc = description;
     m_callback = callback;
 
-    m_sendQueue = xQueueCreate(32, sizeof(QueueItem));
+    m_send_queue = nullptr;
+    m_send_ready = xSemaphoreCreateBinary();
+    m_send_dropped = 0;
+    m_send_pool = nullptr;
 
     m_read_counter = 0;
     m_write_counter = 0;
@@ -43,15 +205,28 @@ Protocol::Protocol(const char* owner, const char* name, const char* description,
     m_udp = nullptr;
     m_ws = nullptr;
 
-    memset(&m_possessed_addr, 0, sizeof(m_possessed_addr));
+    m_wake_socket = -1;
+    m_wake_port = 0;
+
+    memset(&m_recv_stats, 0, sizeof(m_recv_stats));
+
+    m_task_exited = xSemaphoreCreateCounting(2, 0);
 }
 
 Protocol::~Protocol() {
     stop();
-    vQueueDelete(m_sendQueue);
+    vSemaphoreDelete(m_task_exited);
+    vSemaphoreDelete(m_send_ready);
+    delete m_send_queue;
+    delete m_send_pool;
+
+    if (m_wake_socket != -1) {
+        close(m_wake_socket);
+    }
 }
 
 esp_err_t Protocol::start(const ProtocolConfig& cfg) {
+    std::lock_guard<std::mutex> start_lock(m_start_mutex);
     std::lock_guard<std::mutex> lock(m_mutex);
     if (m_task_send != nullptr) {
         return ESP_ERR_INVALID_STATE;
@@ -64,7 +239,10 @@ esp_err_t Protocol::start(const ProtocolConfig& cfg) {
 
     std::unique_ptr<ProtBackendUdp> udp;
     std::unique_ptr<ProtBackendWs> ws;
-    esp_err_t err;
+    esp_err_t err = open_wake_socket();
+    if (err != ESP_OK) {
+        return err;
+    }
 
     if (cfg.enable_udp) {
         udp.reset(new ProtBackendUdp());
@@ -76,12 +254,20 @@ esp_err_t Protocol::start(const ProtocolConfig& cfg) {
 
     if (cfg.enable_ws) {
         ws.reset(new ProtBackendWs());
-        err = ws->start(cfg.ws_register_with_webserver);
+        err = ws->start(cfg.ws_register_with_webserver, [this]() { wake_recv_task(); });
         if (err != ESP_OK) {
             return err;
         }
     }
 
+    // Both are kept for the next start()
+    if (m_send_queue == nullptr) {
+        m_send_queue = new SendQueue(std::max<uint16_t>(cfg.send_queue_depth, 1));
+    }
+    if (m_send_pool == nullptr && cfg.send_buffer_count != 0 && cfg.send_buffer_size != 0) {
+        m_send_pool = new SendPool(std::min<uint16_t>(cfg.send_buffer_count, INT16_MAX), cfg.send_buffer_size);
+    }
+
     m_udp = udp.release();
     m_ws = ws.release();
 
@@ -91,15 +277,30 @@ esp_err_t Protocol::start(const ProtocolConfig& cfg) {
 }
 
 void Protocol::stop() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (m_task_send == nullptr) {
-        return;
+    std::lock_guard<std::mutex> start_lock(m_start_mutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_task_send == nullptr) {
+            return;
+        }
+
+        const TaskHandle_t current = xTaskGetCurrentTaskHandle();
+        if (current == m_task_send || current == m_task_recv) {
+            ESP_LOGE(RBPROT_TAG, "stop() can't be called from the protocol's own tasks, e.g. from the packet callback");
+            return;
+        }
+
+        xTaskNotify(m_task_send, 0, eNoAction);
+        xSemaphoreGive(m_send_ready);
+        xTaskNotify(m_task_recv, 0, eNoAction);
+        wake_recv_task();
     }
 
-    QueueItem it = {};
-    xQueueSendToFront(m_sendQueue, &it, portMAX_DELAY);
-    xTaskNotify(m_task_recv, 0, eNoAction);
+    // Both tasks take m_mutex until they quit, so it is not held while waiting for them
+    xSemaphoreTake(m_task_exited, portMAX_DELAY);
+    xSemaphoreTake(m_task_exited, portMAX_DELAY);
 
+    std::lock_guard<std::mutex> lock(m_mutex);
     delete m_udp;
     delete m_ws;
     m_udp = nullptr;
@@ -107,6 +308,94 @@ void Protocol::stop() {
 
     m_task_send = nullptr;
     m_task_recv = nullptr;
+
+    // Whatever the send task did not get to was meant for this connection
+    QueueItem it;
+    while (m_send_queue->pop(it)) {
+        release_send_buf(it.buf, it.slot);
+    }
+}
+
+esp_err_t Protocol::open_wake_socket() {
+    // Kept open until the destructor and reused by the next start()
+    if (m_wake_socket != -1) {
+        return ESP_OK;
+    }
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd == -1) {
+        ESP_LOGE(RBPROT_TAG, "failed to create wake socket: %s", strerror(errno));
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr*)&addr, &addr_len) < 0) {
+        ESP_LOGE(RBPROT_TAG, "failed to bind wake socket: %s", strerror(errno));
+        close(fd);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    m_wake_socket = fd;
+    m_wake_port = addr.sin_port;
+    return ESP_OK;
+}
+
+void Protocol::wake_recv_task() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = m_wake_port;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const uint8_t wake = 0;
+    if (::sendto(m_wake_socket, &wake, 1, MSG_DONTWAIT, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(RBPROT_TAG, "failed to wake the receive task: %d %s", errno, strerror(errno));
+    }
+}
+
+bool Protocol::wait_for_data() {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(m_wake_socket, &fds);
+    int max_fd = m_wake_socket;
+
+    m_mutex.lock();
+    if (m_udp) {
+        m_udp->add_fds(fds, max_fd);
+    }
+    if (m_ws) {
+        m_ws->add_fds(fds, max_fd);
+    }
+    m_mutex.unlock();
+
+    const int res = select(max_fd + 1, &fds, NULL, NULL, NULL);
+    if (res < 0) {
+        // EBADF when the send task closes a socket that was in the set
+        if (errno != EBADF) {
+            ESP_LOGE(RBPROT_TAG, "error in select: %d %s!", errno, strerror(errno));
+        }
+        vTaskDelay(MS_TO_TICKS(10));
+        return false;
+    }
+
+    if (FD_ISSET(m_wake_socket, &fds)) {
+        uint8_t wake;
+        while (recv(m_wake_socket, &wake, 1, MSG_DONTWAIT) > 0) {
+        }
+        return res > 1;
+    }
+    return true;
+}
+
+ProtocolRecvStats Protocol::get_recv_stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_recv_stats;
 }
 
 bool Protocol::is_addr_empty(const ProtocolAddr& addr) const {
@@ -118,18 +407,12 @@ bool Protocol::is_addr_same(const ProtocolAddr& a, const internal::ProtocolAddr&
 }
 
 bool Protocol::get_possessed_addr(ProtocolAddr& addr) const {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (is_addr_empty(m_possessed_addr))
-        return false;
-    addr = m_possessed_addr;
-    return true;
+    addr = m_possessed_addr.load();
+    return !is_addr_empty(addr);
 }
 
 bool Protocol::is_possessed() const {
-    m_mutex.lock();
-    bool res = !is_addr_empty(m_possessed_addr);
-    m_mutex.unlock();
-    return res;
+    return !is_addr_empty(m_possessed_addr.load());
 }
 
 bool Protocol::is_mustarrive_complete(uint32_t id) const {
@@ -150,48 +433,189 @@ void Protocol::send(const char* cmd, rbjson::Object* obj) {
         ESP_LOGW(RBPROT_TAG, "can't send, the device was not possessed yet.");
         return;
     }
-    send(addr, cmd, obj);
+    send(addr, cmd, obj, SEND_TIMEOUT);
 }
 
-void Protocol::send(const ProtocolAddr& addr, const char* cmd, rbjson::Object* obj) {
+esp_err_t Protocol::try_send(const char* cmd, rbjson::Object* obj) {
+    ProtocolAddr addr;
+    if (!get_possessed_addr(addr)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return send(addr, cmd, obj, 0);
+}
+
+esp_err_t Protocol::send(const ProtocolAddr& addr, const char* cmd, rbjson::Object* obj, TickType_t timeout) {
     std::unique_ptr<rbjson::Object> autoptr;
     if (obj == NULL) {
         obj = new rbjson::Object();
         autoptr.reset(obj);
     }
 
-    obj->set("c", new rbjson::String(cmd));
-    send(addr, obj);
+    obj->set(rbjson::KEY_C, cmd);
+    return send(addr, obj, timeout);
 }
 
-void Protocol::send(const ProtocolAddr& addr, rbjson::Object* obj) {
-    m_mutex.lock();
-    const int n = m_write_counter++;
-    m_mutex.unlock();
-
-    obj->set("n", new rbjson::Number(n));
-    const auto str = obj->str();
-    send(addr, str.c_str(), str.size());
+esp_err_t Protocol::send(const ProtocolAddr& addr, rbjson::Object* obj, TickType_t timeout) {
+    obj->set(rbjson::KEY_N, m_write_counter.fetch_add(1, std::memory_order_relaxed));
+    return send_serialized(addr, obj, timeout);
 }
 
-void Protocol::send(const ProtocolAddr& addr, const char* buf) {
-    send(addr, buf, strlen(buf));
+esp_err_t Protocol::send(const ProtocolAddr& addr, const char* buf) {
+    return send(addr, buf, strlen(buf));
 }
 
-void Protocol::send(const ProtocolAddr& addr, const char* buf, size_t size) {
+esp_err_t Protocol::send(const ProtocolAddr& addr, const char* buf, size_t size) {
     if (size == 0)
-        return;
+        return ESP_OK;
+
+    int16_t slot;
+    char* copy = acquire_send_buf(size, slot, SEND_TIMEOUT);
+    if (copy == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, buf, size);
+    return enqueue(addr, copy, size, slot, SEND_TIMEOUT);
+}
+
+esp_err_t Protocol::send_serialized(const ProtocolAddr& addr, const rbjson::Object* obj, TickType_t timeout) {
+    size_t size;
+    if (m_send_pool != nullptr) {
+        // Serialize straight into a pooled buffer, the writer counts the full length even if it does not fit
+        int16_t slot;
+        char* buf = acquire_send_buf(0, slot, timeout);
+        if (buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
 
+        rbjson::Writer w(buf, m_send_pool->slot_size());
+        obj->serialize(w);
+        if (!w.overflowed()) {
+            return enqueue(addr, buf, w.size(), slot, timeout);
+        }
+        m_send_pool->release(slot);
+        size = w.size();
+    } else {
+        // The first pass only measures the message, so that it is allocated exactly once
+        rbjson::Writer counter(NULL, 0);
+        obj->serialize(counter);
+        size = counter.size();
+    }
+
+    char* buf = new char[size];
+    rbjson::Writer w(buf, size);
+    obj->serialize(w);
+    return enqueue(addr, buf, w.size(), -1, timeout);
+}
+
+char* Protocol::acquire_send_buf(size_t size, int16_t& slot, TickType_t timeout) {
+    slot = -1;
+    if (m_send_pool == nullptr || size > m_send_pool->slot_size()) {
+        return new char[size];
+    }
+
+    slot = m_send_pool->acquire(timeout);
+    if (slot < 0) {
+        ++m_send_dropped;
+        // try_send() reports it to the caller instead
+        if (timeout != 0) {
+            ESP_LOGE(RBPROT_TAG, "failed to send - no free send buffer!");
+        }
+        return NULL;
+    }
+    return m_send_pool->data(slot);
+}
+
+esp_err_t Protocol::enqueue(const ProtocolAddr& addr, char* buf, size_t size, int16_t slot, TickType_t timeout) {
     QueueItem it;
     it.addr = addr;
-    it.buf = new char[size];
+    it.buf = buf;
     it.size = size;
-    memcpy(it.buf, buf, size);
+    it.slot = slot;
+
+    if (m_send_queue == nullptr) {
+        ESP_LOGE(RBPROT_TAG, "failed to send - not started yet!");
+        release_send_buf(it.buf, it.slot);
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    if (xQueueSend(m_sendQueue, &it, pdMS_TO_TICKS(200)) != pdTRUE) {
-        ESP_LOGE(RBPROT_TAG, "failed to send - queue full!");
-        delete[] it.buf;
+    bool was_empty;
+    bool queued = m_send_queue->push(it, was_empty);
+    if (!queued && timeout != 0) {
+        // Only the blocking send() waits, polling is fine for a queue that overflowed anyway
+        const TickType_t start = xTaskGetTickCount();
+        do {
+            vTaskDelay(1);
+            queued = m_send_queue->push(it, was_empty);
+        } while (!queued && xTaskGetTickCount() - start < timeout);
     }
+
+    if (!queued) {
+        ++m_send_dropped;
+        if (timeout != 0) {
+            ESP_LOGE(RBPROT_TAG, "failed to send - queue full!");
+        }
+        release_send_buf(it.buf, it.slot);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The send task keeps popping until the queue is empty, it only needs a wakeup after that
+    if (was_empty) {
+        xSemaphoreGive(m_send_ready);
+    }
+    return ESP_OK;
+}
+
+void Protocol::release_send_buf(char* buf, int16_t slot) {
+    if (slot >= 0) {
+        m_send_pool->release(slot);
+    } else {
+        delete[] buf;
+    }
+}
+
+ProtocolSendStats Protocol::get_send_stats() const {
+    ProtocolSendStats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (m_send_queue != nullptr) {
+        stats.capacity = m_send_queue->capacity();
+        stats.depth = m_send_queue->size();
+        stats.high_watermark = m_send_queue->high_watermark();
+    }
+    if (m_send_pool != nullptr) {
+        stats.buffers = m_send_pool->count();
+        stats.free_buffers = m_send_pool->free_count();
+        stats.buffers_high_watermark = m_send_pool->high_watermark();
+    }
+    stats.dropped = m_send_dropped.load(std::memory_order_relaxed);
+    return stats;
+}
+
+char* internal::serialize_mustarrive(const rbjson::Object* obj, uint16_t& out_size) {
+    rbjson::Writer counter(NULL, 0);
+    obj->serialize(counter);
+
+    const size_t prefix_len = MUST_ARRIVE_N_OFFSET + MUST_ARRIVE_N_LEN;
+    char* buf = new char[prefix_len + counter.size()];
+    memcpy(buf, MUST_ARRIVE_N_PREFIX, MUST_ARRIVE_N_OFFSET);
+
+    rbjson::Writer w(buf + prefix_len, counter.size());
+    obj->serialize(w);
+
+    // The object's opening brace becomes the comma after "n", or the closing brace if it is empty
+    if (w.size() == 2) {
+        buf[prefix_len] = '}';
+        out_size = prefix_len + 1;
+    } else {
+        buf[prefix_len] = ',';
+        out_size = prefix_len + w.size();
+    }
+    return buf;
+}
+
+void internal::write_mustarrive_n(char* buf, int32_t n) {
+    char* slot = buf + MUST_ARRIVE_N_OFFSET;
+    const size_t len = rbjson::formatInt(slot, n);
+    memset(slot + len, ' ', MUST_ARRIVE_N_LEN - len);
 }
 
 uint32_t Protocol::send_mustarrive(const char* cmd, rbjson::Object* params) {
@@ -206,18 +630,25 @@ uint32_t Protocol::send_mustarrive(const char* cmd, rbjson::Object* params) {
         params = new rbjson::Object();
     }
 
-    params->set("c", cmd);
+    params->set(rbjson::KEY_C, cmd);
+    params->remove(rbjson::KEY_N);
 
     MustArrive mr;
-    mr.pkt = params;
     mr.attempts = 0;
 
     m_mustarrive_mutex.lock();
     const uint32_t id = m_mustarrive_e++;
     mr.id = id;
-    params->set("e", mr.id);
+    params->set(rbjson::KEY_E, mr.id);
+
+    // Serialized just once, resends only rewrite "n"
+    mr.buf = serialize_mustarrive(params, mr.size);
+    delete params;
+
+    write_mustarrive_n(mr.buf, m_write_counter.fetch_add(1, std::memory_order_relaxed));
+
     m_mustarrive_queue.emplace_back(mr);
-    send(addr, params);
+    send(addr, mr.buf, mr.size);
     m_mustarrive_mutex.unlock();
 
     return id;
@@ -242,53 +673,135 @@ void Protocol::send_log(const char* fmt, va_list args) {
         vsnprintf(dyn_buf.get(), fmt_len + 1, fmt, args);
     }
 
-    send_log(std::string(used_buf));
+    send_log_msg(rbjson::StringView(used_buf, fmt_len > 0 ? fmt_len : 0));
 }
 
 void Protocol::send_log(const std::string& str) {
+    send_log_msg(str);
+}
+
+void Protocol::send_log_msg(rbjson::StringView msg) {
     rbjson::Object* pkt = new rbjson::Object();
-    pkt->set("msg", str);
+    pkt->set(rbjson::KEY_MSG, msg);
     send_mustarrive("log", pkt);
 }
 
-void Protocol::handle_msg(const ProtocolAddr& addr, rbjson::Object* pkt) {
-    const auto cmd = pkt->getString("c");
+void Protocol::set_visit_callback(visit_callback_t callback) {
+    if (callback && m_document_callback) {
+        ESP_LOGW(RBPROT_TAG, "visit callback replaces the document callback");
+        m_document_callback = nullptr;
+    }
+    m_visit_callback = callback;
+}
 
-    if (cmd == "discover") {
-        std::unique_ptr<rbjson::Object> res(new rbjson::Object());
-        res->set("c", "found");
-        res->set("owner", m_owner);
-        res->set("name", m_name);
-        res->set("desc", m_desc);
+void Protocol::set_document_callback(document_callback_t callback) {
+    if (callback && m_visit_callback) {
+        ESP_LOGW(RBPROT_TAG, "document callback replaces the visit callback");
+        m_visit_callback = nullptr;
+    }
+    m_document_callback = callback;
+}
+
+void Protocol::handle_msg(const ProtocolAddr& addr, char* buf, size_t size, rbjson::Arena& arena, rbjson::TokenPool& tokens) {
+    MsgHeader hdr;
+
+    if (m_visit_callback) {
+        rbjson::Reader reader(tokens);
+        if (!reader.parse(buf, size)) {
+            ESP_LOGE(RBPROT_TAG, "failed to parse the packet's json");
+            return;
+        }
+
+        hdr.cmd = reader.getString("c");
+        hdr.has_n = reader.contains("n");
+        hdr.n = reader.getInt("n");
+        hdr.has_e = reader.contains("e");
+        hdr.e = reader.getInt("e");
+        hdr.has_f = reader.contains("f");
+        hdr.f = reader.getInt("f");
 
-        const auto str = res->str();
-        send(addr, str.c_str(), str.size());
+        if (handle_header(addr, hdr)) {
+            m_visit_callback(hdr.cmd, reader);
+        }
         return;
     }
 
-    if (!pkt->contains("n")) {
-        ESP_LOGE(RBPROT_TAG, "packet does not have counter!");
+    if (m_document_callback) {
+        rbjson::Document doc(tokens, arena);
+        if (!doc.parse(buf, size)) {
+            ESP_LOGE(RBPROT_TAG, "failed to parse the packet's json");
+            arena.reset();
+            return;
+        }
+
+        hdr.cmd = doc.getStringView(rbjson::KEY_C).data();
+        hdr.has_n = doc.contains(rbjson::KEY_N);
+        hdr.n = doc.getInt(rbjson::KEY_N);
+        hdr.has_e = doc.contains(rbjson::KEY_E);
+        hdr.e = doc.getInt(rbjson::KEY_E);
+        hdr.has_f = doc.contains(rbjson::KEY_F);
+        hdr.f = doc.getInt(rbjson::KEY_F);
+
+        if (handle_header(addr, hdr)) {
+            m_document_callback(hdr.cmd, doc);
+        }
+        arena.reset();
         return;
     }
 
-    const bool isPossessCmd = cmd == "possess";
+    rbjson::ObjectPtr pkt(rbjson::parse(buf, size, arena, tokens, rbjson::PARSE_BORROW_STRINGS), &arena);
+    if (!pkt) {
+        ESP_LOGE(RBPROT_TAG, "failed to parse the packet's json");
+        arena.reset();
+        return;
+    }
+
+    hdr.cmd = pkt->getStringView(rbjson::KEY_C).data();
+    hdr.has_n = pkt->contains(rbjson::KEY_N);
+    hdr.n = pkt->getInt(rbjson::KEY_N);
+    hdr.has_e = pkt->contains(rbjson::KEY_E);
+    hdr.e = pkt->getInt(rbjson::KEY_E);
+    hdr.has_f = pkt->contains(rbjson::KEY_F);
+    hdr.f = pkt->getInt(rbjson::KEY_F);
+
+    if (handle_header(addr, hdr) && m_callback != NULL) {
+        m_callback(hdr.cmd, pkt.get());
+    }
+}
+
+bool Protocol::handle_header(const ProtocolAddr& addr, const MsgHeader& hdr) {
+    if (strcmp(hdr.cmd, "discover") == 0) {
+        std::unique_ptr<rbjson::Object> res(new rbjson::Object());
+        res->set(rbjson::KEY_C, "found");
+        res->set(rbjson::KEY_OWNER, m_owner);
+        res->set(rbjson::KEY_NAME, m_name);
+        res->set(rbjson::KEY_DESC, m_desc);
+
+        send_serialized(addr, res.get(), SEND_TIMEOUT);
+        return false;
+    }
+
+    if (!hdr.has_n) {
+        ESP_LOGE(RBPROT_TAG, "packet does not have counter!");
+        return false;
+    }
 
-    const int counter = pkt->getInt("n");
+    const bool isPossessCmd = strcmp(hdr.cmd, "possess") == 0;
+
+    const int counter = hdr.n;
     if (counter == -1 || isPossessCmd) {
         m_read_counter = 0;
-        m_mutex.lock();
         m_write_counter = 0;
-        m_mutex.unlock();
     } else if (counter < m_read_counter && m_read_counter - counter < 25) {
-        return;
+        return false;
     } else {
         m_read_counter = counter;
     }
 
-    if (is_addr_empty(m_possessed_addr) || isPossessCmd) {
+    if (is_addr_empty(m_possessed_addr.load()) || isPossessCmd) {
         m_mutex.lock();
-        if (!is_addr_same(m_possessed_addr, addr)) {
-            m_possessed_addr = addr;
+        if (!is_addr_same(m_possessed_addr.load(), addr)) {
+            m_possessed_addr.store(addr);
         }
         m_mustarrive_e = 0;
         m_mustarrive_f = 0xFFFFFFFF;
@@ -298,38 +811,38 @@ void Protocol::handle_msg(const ProtocolAddr& addr, rbjson::Object* pkt) {
 
         m_mustarrive_mutex.lock();
         for (auto it : m_mustarrive_queue) {
-            delete it.pkt;
+            delete[] it.buf;
         }
         m_mustarrive_queue.clear();
         m_mustarrive_mutex.unlock();
     }
 
-    if (pkt->contains("f")) {
+    if (hdr.has_f) {
         {
             std::unique_ptr<rbjson::Object> resp(new rbjson::Object);
-            resp->set("c", cmd);
-            resp->set("f", pkt->getInt("f"));
-            send(addr, resp.get());
+            resp->set(rbjson::KEY_C, hdr.cmd);
+            resp->set(rbjson::KEY_F, hdr.f);
+            send(addr, resp.get(), SEND_TIMEOUT);
         }
 
-        int f = pkt->getInt("f");
+        int f = hdr.f;
         if (f <= m_mustarrive_f && m_mustarrive_f != 0xFFFFFFFF) {
-            return;
+            return false;
         } else {
             m_mustarrive_f = f;
         }
-    } else if (pkt->contains("e")) {
-        uint32_t e = pkt->getInt("e");
+    } else if (hdr.has_e) {
+        uint32_t e = hdr.e;
         m_mustarrive_mutex.lock();
         for (auto itr = m_mustarrive_queue.begin(); itr != m_mustarrive_queue.end(); ++itr) {
             if ((*itr).id == e) {
-                delete (*itr).pkt;
+                delete[] (*itr).buf;
                 m_mustarrive_queue.erase(itr);
                 break;
             }
         }
         m_mustarrive_mutex.unlock();
-        return;
+        return false;
     }
 
     if (isPossessCmd) {
@@ -337,9 +850,7 @@ void Protocol::handle_msg(const ProtocolAddr& addr, rbjson::Object* pkt) {
         send_log("The device %s has been possessed!\n", m_name);
     }
 
-    if (m_callback != NULL) {
-        m_callback(cmd, pkt);
-    }
+    return true;
 }
 
 void Protocol::resend_mustarrive_locked() {
@@ -351,14 +862,14 @@ void Protocol::resend_mustarrive_locked() {
         if (possesed_addr.kind == ProtBackendType::PROT_UDP) {
             m_mutex.lock();
             if (m_udp) {
-                itr->pkt->set("n", m_write_counter++);
-                m_udp->resend_mustarrive(possesed_addr, itr->pkt);
+                write_mustarrive_n(itr->buf, m_write_counter.fetch_add(1, std::memory_order_relaxed));
+                m_udp->resend_mustarrive(possesed_addr, itr->buf, itr->size);
             }
             m_mutex.unlock();
         }
 
         if (++(*itr).attempts >= MUST_ARRIVE_ATTEMPTS) {
-            delete (*itr).pkt;
+            delete[] (*itr).buf;
             itr = m_mustarrive_queue.erase(itr);
         } else {
             ++itr;
@@ -374,12 +885,9 @@ void Protocol::send_task(void* selfVoid) {
 
     mustarrive_next = xTaskGetTickCount() + MUST_ARRIVE_TIMER_PERIOD;
 
-    while (true) {
-        for (uint8_t i = 0; i < 16 && xQueueReceive(self.m_sendQueue, &it, MS_TO_TICKS(10)) == pdTRUE; ++i) {
-            if (it.addr.kind == ProtBackendType::PROT_NONE) {
-                goto exit;
-            }
-
+    while (xTaskNotifyWait(0, 0, NULL, 0) == pdFALSE) {
+        uint8_t sent = 0;
+        for (; sent < 16 && self.m_send_queue->pop(it); ++sent) {
             self.m_mutex.lock();
             switch (it.addr.kind) {
             case ProtBackendType::PROT_UDP:
@@ -397,7 +905,7 @@ void Protocol::send_task(void* selfVoid) {
             }
             self.m_mutex.unlock();
 
-            delete[] it.buf;
+            self.release_send_buf(it.buf, it.slot);
         }
 
         if (xTaskGetTickCount() >= mustarrive_next) {
@@ -408,9 +916,20 @@ void Protocol::send_task(void* selfVoid) {
             self.m_mustarrive_mutex.unlock();
             mustarrive_next = xTaskGetTickCount() + MUST_ARRIVE_TIMER_PERIOD;
         }
+
+        // The semaphore may still be given for messages that were already sent, that only costs one more iteration
+        if (sent < 16) {
+            if (self.m_send_queue->size() == 0) {
+                xSemaphoreTake(self.m_send_ready, MS_TO_TICKS(10));
+            } else {
+                // A producer claimed a cell but did not fill it yet, and it did not find the queue empty
+                vTaskDelay(1);
+            }
+        }
     }
 
-exit:
+    // self may be destroyed as soon as stop() gets this
+    xSemaphoreGive(self.m_task_exited);
     vTaskDelete(nullptr);
 }
 
@@ -418,47 +937,54 @@ void Protocol::recv_task(void* selfVoid) {
     auto& self = *((Protocol*)selfVoid);
 
     {
-        // destructors do not run after vTaskDelete, so put this vector in separate block to enforce it
-        std::vector<uint8_t> buf;
-        buf.resize(64);
+        // destructors do not run after vTaskDelete, so put these buffers in separate block to enforce it
+        // The first half of the slots is for UDP, the second for WS
+        std::vector<RecvSlot> slots(2 * RBPROTOCOL_RECV_BATCH);
+        for (auto& slot : slots) {
+            slot.buf.resize(64);
+        }
 
-        ProtocolAddr recv_addr;
+        // Received packets are parsed into this arena, it is reset when the pkt pointer drops
+        rbjson::Arena arena;
+        // Tokens of big packets, grows to the biggest one received and stays allocated
+        rbjson::TokenPool tokens;
 
-        while (xTaskNotifyWait(0, 0, NULL, 0) == pdFALSE) {
-            bool received_msg = false;
+        bool had_data = false;
 
+        while (xTaskNotifyWait(0, 0, NULL, 0) == pdFALSE) {
+            // Take everything pending, up to the batch size from each backend, under a single lock
             self.m_mutex.lock();
-            if (self.m_udp) {
-                auto pkt = self.m_udp->recv_iter(buf, recv_addr);
-                if (pkt) {
-                    self.m_mutex.unlock();
-                    self.handle_msg(recv_addr, pkt.get());
-                    pkt.reset();
-                    received_msg = true;
-                    self.m_mutex.lock();
-                }
+            const size_t udp_count = self.m_udp ? self.m_udp->recv_batch(slots.data(), RBPROTOCOL_RECV_BATCH) : 0;
+            const size_t ws_count = self.m_ws ? self.m_ws->recv_batch(slots.data() + RBPROTOCOL_RECV_BATCH, RBPROTOCOL_RECV_BATCH) : 0;
+            const size_t count = udp_count + ws_count;
+            if (count != 0) {
+                ++self.m_recv_stats.batches;
+                self.m_recv_stats.messages += count;
+                self.m_recv_stats.last_batch = count;
+                self.m_recv_stats.max_batch = std::max(self.m_recv_stats.max_batch, (uint16_t)count);
             }
+            self.m_mutex.unlock();
 
-            if (self.m_ws) {
-                auto pkt = self.m_ws->recv_iter(buf, recv_addr);
-                if (pkt) {
-                    self.m_mutex.unlock();
-                    self.handle_msg(recv_addr, pkt.get());
-                    pkt.reset();
-                    received_msg = true;
-                } else {
-                    self.m_mutex.unlock();
-                }
-            } else {
-                self.m_mutex.unlock();
+            for (size_t i = 0; i < count; ++i) {
+                RecvSlot& slot = slots[i < udp_count ? i : RBPROTOCOL_RECV_BATCH + i - udp_count];
+                self.handle_msg(slot.addr, (char*)slot.buf.data(), slot.size, arena, tokens);
+            }
+
+            if (count != 0) {
+                had_data = false;
+                continue;
             }
 
-            if (!received_msg) {
-                vTaskDelay(MS_TO_TICKS(10));
+            // A readable socket without a whole message, e.g. a WS frame split into
+            // several TCP segments, would make select() return right away again
+            if (had_data) {
+                vTaskDelay(1);
             }
+            had_data = self.wait_for_data();
         }
     }
 
+    xSemaphoreGive(self.m_task_exited);
     vTaskDelete(nullptr);
 }
 
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #include <functional>
 #include <lwip/arch.h>
@@ -18,6 +20,15 @@
 #define RBPROTOCOL_AXIS_MIN (-32767) //!< Minimal value of axes in "joy" command
 #define RBPROTOCOL_AXIS_MAX (32767) //!< Maximal value of axes in "joy" command
 
+// Must-arrive packets start with "n", its value is padded with spaces to fit any counter
+#define MUST_ARRIVE_N_PREFIX "{\"n\":"
+#define MUST_ARRIVE_N_OFFSET (sizeof(MUST_ARRIVE_N_PREFIX) - 1)
+#define MUST_ARRIVE_N_LEN 11 // "-2147483648"
+
+#ifndef RBPROTOCOL_RECV_BATCH
+#define RBPROTOCOL_RECV_BATCH 8 //!< Messages taken from each backend per iteration of the receive task
+#endif
+
 namespace rb {
 
 namespace internal {
@@ -48,32 +59,207 @@ struct QueueItem {
     ProtocolAddr addr;
     char* buf;
     uint16_t size;
+    int16_t slot; //!< Index of buf in the SendPool, -1 if buf was allocated with new[]
+};
+
+char* serialize_mustarrive(const rbjson::Object* obj, uint16_t& out_size); //!< With a blank "n" slot in front of the members, allocated with new[]
+void write_mustarrive_n(char* buf, int32_t n); //!< Fills the "n" slot of a serialize_mustarrive() buffer
+
+/**
+ * \brief Fixed set of equally sized send buffers, allocated in one block.
+ *
+ * Indexes of the free slots are kept in a FreeRTOS queue, so acquire() can wait
+ * for the send task to release one and neither of them touches the heap.
+ */
+class SendPool {
+public:
+    SendPool(uint16_t count, uint16_t slot_size);
+    ~SendPool();
+
+    int16_t acquire(TickType_t timeout); //!< Returns the index of a free slot, -1 if none got free in time
+    void release(int16_t slot);
+
+    char* data(int16_t slot) const { return m_buf + size_t(slot) * m_slot_size; }
+    uint16_t slot_size() const { return m_slot_size; }
+    uint16_t count() const { return m_count; }
+    uint16_t free_count() const { return uxQueueMessagesWaiting(m_free); }
+    uint16_t high_watermark() const { return m_high_watermark.load(std::memory_order_relaxed); } //!< Most slots in use at once
+
+private:
+    SendPool(const SendPool&) = delete;
+    SendPool& operator=(const SendPool&) = delete;
+
+    char* m_buf;
+    QueueHandle_t m_free;
+    uint16_t m_slot_size;
+    uint16_t m_count;
+    std::atomic<uint16_t> m_in_use;
+    std::atomic<uint16_t> m_high_watermark;
+};
+
+/**
+ * \brief Bounded lock-free queue of messages for the send task.
+ *
+ * Every cell has a sequence number that tells producers and the consumer whose turn
+ * it is, so push() and pop() never block and never take a lock. More consumers are
+ * safe too, stop() drains what is left once the send task has quit.
+ */
+class SendQueue {
+public:
+    explicit SendQueue(uint16_t capacity); //!< Rounded up to a power of two, at most 32768
+    ~SendQueue();
+
+    bool push(const QueueItem& item, bool& was_empty); //!< Returns false if the queue is full
+    bool pop(QueueItem& out); //!< Returns false if the queue is empty
+
+    uint16_t capacity() const { return m_mask + 1; }
+    uint16_t size() const;
+    uint16_t high_watermark() const { return m_high_watermark.load(std::memory_order_relaxed); }
+
+private:
+    SendQueue(const SendQueue&) = delete;
+    SendQueue& operator=(const SendQueue&) = delete;
+
+    struct Cell {
+        std::atomic<uint32_t> seq;
+        QueueItem item;
+    };
+
+    Cell* m_cells;
+    uint32_t m_mask;
+    std::atomic<uint32_t> m_enqueue_pos;
+    std::atomic<uint32_t> m_dequeue_pos;
+    std::atomic<uint16_t> m_high_watermark;
+};
+
+/**
+ * \brief Copy of a ProtocolAddr that can be read without a lock.
+ *
+ * A sequence lock over atomic words: store() makes the sequence odd while it
+ * rewrites the words and load() retries until it reads the same even sequence
+ * before and after its copy. Readers never block, stores must not run concurrently.
+ */
+class AddrSnapshot {
+public:
+    AddrSnapshot();
+
+    void store(const ProtocolAddr& addr);
+    ProtocolAddr load() const;
+
+private:
+    AddrSnapshot(const AddrSnapshot&) = delete;
+    AddrSnapshot& operator=(const AddrSnapshot&) = delete;
+
+    static const size_t WORDS = (sizeof(ProtocolAddr) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+    std::atomic<uint32_t> m_seq;
+    std::atomic<uint32_t> m_words[WORDS];
+};
+
+struct RecvSlot {
+    std::vector<uint8_t> buf; //!< Reused for the next batch, grows to the biggest message
+    size_t size;
+    ProtocolAddr addr;
 };
 
 class ProtBackendUdp;
 class ProtBackendWs;
 };
 
+/**
+ * \brief Receive batch statistics, see Protocol::get_recv_stats().
+ *
+ * The receive task takes up to RBPROTOCOL_RECV_BATCH messages from each backend
+ * at once, messages / batches is the average batch size.
+ */
+struct ProtocolRecvStats {
+    uint32_t batches; //!< Iterations of the receive task that got at least one message
+    uint32_t messages;
+    uint16_t last_batch;
+    uint16_t max_batch;
+};
+
+/**
+ * \brief Send queue statistics, see Protocol::get_send_stats().
+ *
+ * Producers that must not stall can use Protocol::try_send() and back off
+ * while depth gets close to capacity.
+ */
+struct ProtocolSendStats {
+    uint16_t capacity;
+    uint16_t depth; //!< Messages waiting for the send task
+    uint16_t high_watermark; //!< Deepest the queue has been
+    uint32_t dropped; //!< Messages not sent because the queue or all send buffers were full
+
+    uint16_t buffers; //!< ProtocolConfig::send_buffer_count, 0 if every message is allocated
+    uint16_t free_buffers;
+    uint16_t buffers_high_watermark; //!< Most send buffers in use at once
+};
+
 struct ProtocolConfig {
     bool enable_udp;
     bool enable_ws;
     bool ws_register_with_webserver;
     uint16_t udp_port;
+
+    /**
+     * Outgoing messages are serialized straight into one of send_buffer_count buffers
+     * of send_buffer_size bytes, allocated by the first start() and kept until the
+     * Protocol is destroyed. Longer messages are allocated on the heap instead.
+     * When all buffers are queued, the sender waits for one like for a full queue
+     * and the message is dropped after 200 ms. Count 0 allocates every message.
+     * Keep the count at send_queue_depth, with fewer buffers the rest of the queue
+     * can only hold allocated messages.
+     */
+    uint16_t send_buffer_count;
+    uint16_t send_buffer_size;
+
+    uint16_t send_queue_depth; //!< Messages waiting for the send task, rounded up to a power of two. Used by the first start().
 };
 
 class Protocol {
 public:
+    //! pkt is allocated in the receive arena and valid only during the call, copy() it to keep it.
     typedef std::function<void(const std::string& cmd, rbjson::Object* pkt)> callback_t;
+    typedef std::function<void(const char* cmd, rbjson::Reader& pkt)> visit_callback_t;
+    typedef std::function<void(const char* cmd, const rbjson::Document& pkt)> document_callback_t;
 
     static const ProtocolConfig DEFAULT_CONFIG;
 
     Protocol(const char* owner, const char* name, const char* description, callback_t callback = nullptr);
     ~Protocol();
 
+    /**
+     * \brief Receive packets through a rbjson::Reader instead of parsing them to rbjson::Object.
+     *
+     * The callback is then called instead of the one passed to the constructor and
+     * no packet is allocated on the heap. Clears the set_document_callback() one,
+     * only one of them can be active. Must be set before start().
+     */
+    void set_visit_callback(visit_callback_t callback);
+
+    /**
+     * \brief Receive packets as a read-only rbjson::Document instead of rbjson::Object.
+     *
+     * The callback is then called instead of the one passed to the constructor.
+     * The document is valid only during the callback. Clears the set_visit_callback() one,
+     * only one of them can be active. Must be set before start().
+     */
+    void set_document_callback(document_callback_t callback);
+
     esp_err_t start(const ProtocolConfig& cfg = DEFAULT_CONFIG);
-    void stop();
+    void stop(); //!< Waits for both tasks to quit, so it must not be called from the callbacks
 
     void send(const char* cmd, rbjson::Object* params = NULL);
+
+    /**
+     * \brief Like send(), but never waits for space in the send queue or for a send buffer.
+     *
+     * Returns ESP_OK when the message was queued, ESP_ERR_INVALID_STATE when the device
+     * was not possessed yet and ESP_ERR_NO_MEM when the message was dropped because
+     * the queue or the send buffers are full.
+     */
+    esp_err_t try_send(const char* cmd, rbjson::Object* params = NULL);
     uint32_t send_mustarrive(const char* cmd, rbjson::Object* params = NULL);
 
     void send_log(const char* fmt, ...);
@@ -82,6 +268,8 @@ public:
 
     bool is_possessed() const; //!< Returns true of the device is possessed (somebody connected to it)
     bool is_mustarrive_complete(uint32_t id) const;
+    ProtocolRecvStats get_recv_stats() const;
+    ProtocolSendStats get_send_stats() const; //!< Does not lock, can be called on every send
 
     TaskHandle_t getTaskSend() const { return m_task_send; }
     TaskHandle_t getTaskRecv() const { return m_task_recv; }
@@ -90,39 +278,73 @@ private:
     Protocol(Protocol&) = delete;
 
     struct MustArrive {
-        rbjson::Object* pkt;
+        char* buf; //!< Serialized packet, "n" is rewritten in place before every resend
+        uint16_t size;
         uint32_t id;
         int16_t attempts;
     };
 
+    struct MsgHeader {
+        const char* cmd;
+        int32_t n;
+        uint32_t e;
+        int32_t f;
+        bool has_n;
+        bool has_e;
+        bool has_f;
+    };
+
     static void send_task(void* selfVoid);
     static void recv_task(void* selfVoid);
 
-    void handle_msg(const internal::ProtocolAddr& addr, rbjson::Object* pkt);
+    esp_err_t open_wake_socket();
+    void wake_recv_task(); //!< Makes the receive task return from wait_for_data()
+    bool wait_for_data(); //!< Blocks until a backend has data or the task is woken up, returns true on data
+
+    void handle_msg(const internal::ProtocolAddr& addr, char* buf, size_t size, rbjson::Arena& arena, rbjson::TokenPool& tokens);
+    bool handle_header(const internal::ProtocolAddr& addr, const MsgHeader& hdr); //!< Returns true if the packet should be passed to the callback
     void resend_mustarrive_locked();
 
     bool get_possessed_addr(internal::ProtocolAddr& addr) const;
     bool is_addr_empty(const internal::ProtocolAddr& addr) const;
     bool is_addr_same(const internal::ProtocolAddr& a, const internal::ProtocolAddr& b) const;
 
-    void send(const internal::ProtocolAddr& addr, const char* command, rbjson::Object* obj);
-    void send(const internal::ProtocolAddr& addr, rbjson::Object* obj);
-    void send(const internal::ProtocolAddr& addr, const char* buf);
-    void send(const internal::ProtocolAddr& addr, const char* buf, size_t size);
+    // The timeout is how long to wait for a send buffer and then for space in the send queue
+    esp_err_t send(const internal::ProtocolAddr& addr, const char* command, rbjson::Object* obj, TickType_t timeout);
+    esp_err_t send(const internal::ProtocolAddr& addr, rbjson::Object* obj, TickType_t timeout);
+    esp_err_t send(const internal::ProtocolAddr& addr, const char* buf);
+    esp_err_t send(const internal::ProtocolAddr& addr, const char* buf, size_t size);
+    esp_err_t send_serialized(const internal::ProtocolAddr& addr, const rbjson::Object* obj, TickType_t timeout);
+    void send_log_msg(rbjson::StringView msg);
+    char* acquire_send_buf(size_t size, int16_t& slot, TickType_t timeout); //!< Returns a buffer from the send pool, or from the heap if it is too long
+    esp_err_t enqueue(const internal::ProtocolAddr& addr, char* buf, size_t size, int16_t slot, TickType_t timeout); //!< Takes ownership of buf
+    void release_send_buf(char* buf, int16_t slot);
 
     const char* m_owner;
     const char* m_name;
     const char* m_desc;
 
     callback_t m_callback;
+    visit_callback_t m_visit_callback;
+    document_callback_t m_document_callback;
 
     int32_t m_read_counter;
-    int32_t m_write_counter;
-    internal::ProtocolAddr m_possessed_addr;
-    QueueHandle_t m_sendQueue;
+    std::atomic<int32_t> m_write_counter;
+    internal::AddrSnapshot m_possessed_addr; //!< Stored under m_mutex, loaded without it
+    internal::SendQueue* m_send_queue;
+    SemaphoreHandle_t m_send_ready; //!< Given by pushes to an empty queue, the send task waits on it
+    std::atomic<uint32_t> m_send_dropped;
+    internal::SendPool* m_send_pool;
     internal::ProtBackendUdp* m_udp;
     internal::ProtBackendWs* m_ws;
     mutable std::mutex m_mutex;
+    std::mutex m_start_mutex; //!< Serializes start() and stop(), which waits for the tasks without holding m_mutex
+    SemaphoreHandle_t m_task_exited; //!< Given by each task right before it deletes itself
+
+    // Loopback UDP socket in the receive task's select(), stop() and new WS clients write to it
+    int m_wake_socket;
+    uint16_t m_wake_port;
+    ProtocolRecvStats m_recv_stats;
 
     uint32_t m_mustarrive_e;
     uint32_t m_mustarrive_f;
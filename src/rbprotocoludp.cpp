@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <esp_log.h>
 #include <cstring>
 
@@ -68,7 +69,7 @@ void ProtBackendUdp::send_from_queue(const QueueItem& it) {
     }
 }
 
-void ProtBackendUdp::resend_mustarrive(const ProtocolAddr& addr, const rbjson::Object* pkt) {
+void ProtBackendUdp::resend_mustarrive(const ProtocolAddr& addr, const char* buf, size_t size) {
     struct sockaddr_in send_addr = {
         .sin_len = sizeof(struct sockaddr_in),
         .sin_family = AF_INET,
@@ -79,14 +80,34 @@ void ProtBackendUdp::resend_mustarrive(const ProtocolAddr& addr, const rbjson::O
     send_addr.sin_port = addr.udp.port;
     send_addr.sin_addr = addr.udp.ip;
 
-    const auto str = pkt->str();
-    int res = ::sendto(m_socket, str.c_str(), str.size(), 0, (struct sockaddr*)&send_addr, sizeof(struct sockaddr_in));
+    int res = ::sendto(m_socket, buf, size, 0, (struct sockaddr*)&send_addr, sizeof(struct sockaddr_in));
     if (res < 0) {
         ESP_LOGE(RBPROT_TAG, "error in sendto: %d %s!", errno, strerror(errno));
     }
 }
 
-std::unique_ptr<rbjson::Object> ProtBackendUdp::recv_iter(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr) {
+void ProtBackendUdp::add_fds(fd_set& fds, int& max_fd) const {
+    if (m_socket == -1) {
+        return;
+    }
+    FD_SET(m_socket, &fds);
+    max_fd = std::max(max_fd, m_socket);
+}
+
+size_t ProtBackendUdp::recv_batch(RecvSlot* slots, size_t count) {
+    size_t received = 0;
+    while (received < count) {
+        RecvSlot& slot = slots[received];
+        slot.size = recv_iter(slot.buf, slot.addr);
+        if (slot.size == 0) {
+            break;
+        }
+        ++received;
+    }
+    return received;
+}
+
+size_t ProtBackendUdp::recv_iter(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr) {
     ssize_t received_len = 0;
     while (true) {
         received_len = recvfrom(m_socket, buf.data(), buf.size(), MSG_PEEK | MSG_DONTWAIT, NULL, NULL);
@@ -95,7 +116,7 @@ std::unique_ptr<rbjson::Object> ProtBackendUdp::recv_iter(std::vector<uint8_t>&
             if (err != EAGAIN) { // with MSG_DONTWAIT, it means no message available
                 ESP_LOGE(RBPROT_TAG, "error in recvfrom: %d %s!", err, strerror(err));
             }
-            return nullptr;
+            return 0;
         }
 
         if (received_len < buf.size())
@@ -110,19 +131,13 @@ std::unique_ptr<rbjson::Object> ProtBackendUdp::recv_iter(std::vector<uint8_t>&
     if (pop_res < 0) {
         const auto err = errno;
         ESP_LOGE(RBPROT_TAG, "error in recvfrom: %d %s!", err, strerror(err));
-        return nullptr;
-    }
-
-    std::unique_ptr<rbjson::Object> pkt(rbjson::parse((char*)buf.data(), received_len));
-    if (!pkt) {
-        ESP_LOGE(RBPROT_TAG, "failed to parse the packet's json");
-        return nullptr;
+        return 0;
     }
 
     out_received_addr.kind = ProtBackendType::PROT_UDP;
     out_received_addr.udp.port = addr.sin_port;
     out_received_addr.udp.ip = addr.sin_addr;
-    return pkt;
+    return received_len;
 }
 
 };
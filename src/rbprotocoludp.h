@@ -13,9 +13,11 @@ public:
     esp_err_t start(uint16_t port);
 
     void send_from_queue(const QueueItem& it);
-    void resend_mustarrive(const ProtocolAddr& addr, const rbjson::Object* pkt);
+    void resend_mustarrive(const ProtocolAddr& addr, const char* buf, size_t size);
 
-    std::unique_ptr<rbjson::Object> recv_iter(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr);
+    size_t recv_iter(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr); //!< Returns the size of the message received into buf, 0 if there is none
+    size_t recv_batch(RecvSlot* slots, size_t count); //!< Receives up to count datagrams without blocking, returns how many
+    void add_fds(fd_set& fds, int& max_fd) const; //!< Adds the socket to a select() read set
 
 private:
     int m_socket;
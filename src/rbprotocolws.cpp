@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <esp_log.h>
 #include <cstring>
 
@@ -27,7 +28,8 @@ ProtBackendWs::~ProtBackendWs() {
     m_clients_mu.unlock();
 }
 
-esp_err_t ProtBackendWs::start(bool register_with_webserver) {
+esp_err_t ProtBackendWs::start(bool register_with_webserver, std::function<void()> on_new_client) {
+    m_on_new_client = std::move(on_new_client);
     if (register_with_webserver) {
         rb_web_set_wsprotocol(this);
     }
@@ -64,6 +66,19 @@ void ProtBackendWs::addClient(int fd) {
     m_clients_mu.lock();
     m_clients.push_back(std::unique_ptr<Client>(new Client(fd)));
     m_clients_mu.unlock();
+
+    // The receive task is blocked in select() without this client's socket
+    if (m_on_new_client) {
+        m_on_new_client();
+    }
+}
+
+void ProtBackendWs::add_fds(fd_set& fds, int& max_fd) {
+    std::lock_guard<std::mutex> lock(m_clients_mu);
+    for (const auto& client : m_clients) {
+        FD_SET(client->fd, &fds);
+        max_fd = std::max(max_fd, client->fd);
+    }
 }
 
 void ProtBackendWs::close_client(int fd) {
@@ -107,6 +122,12 @@ static int read_at_least(int fd, uint8_t* buf, size_t n) {
         }
     }
 
+    // The peer closed its side, the socket would stay readable forever
+    if (res == 0) {
+        ESP_LOGI(RBPROT_TAG, "WS client %d closed the connection", fd);
+        return -1;
+    }
+
     if (res < n) {
         return 0;
     }
@@ -219,45 +240,70 @@ int ProtBackendWs::process_client(Client& client, std::vector<uint8_t>& buf) {
     return 0;
 }
 
-std::unique_ptr<rbjson::Object> ProtBackendWs::process_client_fully_received_locked(ProtBackendWs::Client& client, ProtocolAddr& out_received_addr) {
+size_t ProtBackendWs::process_client_fully_received_locked(ProtBackendWs::Client& client, std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr) {
     client.state = ClientState::INITIAL;
 
     if (client.opcode() == WS_OPCODE_CLOSE) {
         close_client_locked_gracefully(client.fd);
-        return nullptr;
+        return 0;
     } else {
         ESP_LOGV(RBPROT_TAG, "parsing message %d %.*s", client.fd, client.payload.size(), (char*)client.payload.data());
 
-        std::unique_ptr<rbjson::Object> pkt(rbjson::parse((char*)client.payload.data(), client.payload.size()));
-        if (!pkt) {
-            ESP_LOGE(RBPROT_TAG, "failed to parse the packet's json");
-            return nullptr;
-        }
+        // The parsed strings point into the message, move it out of the client,
+        // which can be closed by the send task while the packet is being handled.
+        buf.swap(client.payload);
 
         out_received_addr.kind = ProtBackendType::PROT_WS;
         out_received_addr.ws.fd = client.fd;
-        return pkt;
+        return buf.size();
     }
 }
 
-std::unique_ptr<rbjson::Object> ProtBackendWs::recv_iter(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr) {
+size_t ProtBackendWs::recv_batch(RecvSlot* slots, size_t count) {
     std::lock_guard<std::mutex> lock(m_clients_mu);
 
+    size_t received = 0;
+    while (received < count) {
+        RecvSlot& slot = slots[received];
+        slot.size = recv_iter_locked(slot.buf, slot.addr);
+        if (slot.size == 0) {
+            break;
+        }
+        ++received;
+    }
+    return received;
+}
+
+size_t ProtBackendWs::recv_iter_locked(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr) {
+    // buf may hold a smaller message swapped out of a client
+    if (buf.size() < 64) {
+        buf.resize(64);
+    }
+
     for (auto itr = m_clients.begin(); itr != m_clients.end();) {
         auto& client = *itr->get();
 
-        if (process_client(client, buf) < 0) {
+        // process_client() moves the client by one state, keep going while it makes progress,
+        // so that a frame which is already buffered in the socket is received in a single pass.
+        int res;
+        ClientState prev_state;
+        do {
+            prev_state = client.state;
+            res = process_client(client, buf);
+        } while (res >= 0 && client.state != ClientState::FULLY_RECEIVED && (res > 0 || client.state != prev_state));
+
+        if (res < 0) {
             close(client.fd);
             itr = m_clients.erase(itr);
             continue;
         } else if (client.state == ClientState::FULLY_RECEIVED) {
-            return process_client_fully_received_locked(client, out_received_addr);
+            return process_client_fully_received_locked(client, buf, out_received_addr);
         }
 
         ++itr;
     }
 
-    return nullptr;
+    return 0;
 }
 
 };
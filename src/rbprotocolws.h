@@ -10,11 +10,12 @@ public:
     ProtBackendWs();
     ~ProtBackendWs();
 
-    esp_err_t start(bool register_with_webserver);
+    esp_err_t start(bool register_with_webserver, std::function<void()> on_new_client);
 
     void send_from_queue(const QueueItem& it);
 
-    std::unique_ptr<rbjson::Object> recv_iter(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr);
+    size_t recv_batch(RecvSlot* slots, size_t count); //!< Receives up to count messages without blocking, returns how many
+    void add_fds(fd_set& fds, int& max_fd); //!< Adds all client sockets to a select() read set
 
     void addClient(int fd);
 
@@ -48,7 +49,8 @@ private:
 
     int process_client(Client& client, std::vector<uint8_t>& buf);
     int process_client_header(Client& client, std::vector<uint8_t>& buf);
-    std::unique_ptr<rbjson::Object> process_client_fully_received_locked(Client& client, ProtocolAddr& out_received_addr);
+    size_t recv_iter_locked(std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr); //!< Returns the size of the message received into buf, 0 if there is none
+    size_t process_client_fully_received_locked(Client& client, std::vector<uint8_t>& buf, ProtocolAddr& out_received_addr);
 
     void close_client(int fd);
     void close_client_locked(int fd);
@@ -56,6 +58,7 @@ private:
 
     std::vector<std::unique_ptr<Client>> m_clients;
     std::mutex m_clients_mu;
+    std::function<void()> m_on_new_client;
 };
 
 };